@@ -0,0 +1,1652 @@
+// rectilinearize.h - single header build of librectilinearize, generated by nobuild from src/main.h and
+// src/main.c. Do not edit.
+//
+// Define RECTILINEARIZE_IMPLEMENTATION in *one* C file before including this file to compile the extractor into
+// it. Define RECTILINEARIZE_STATIC as well to make every function static to that file. The implementation
+// includes stb_image.h and stb_ds.h, defining STB_IMAGE_IMPLEMENTATION and STB_DS_IMPLEMENTATION in the same
+// file compiles them with the allocator of the extractor. Otherwise build/stb_image.o and build/stb_ds.o have
+// to be linked.
+
+#ifndef RECTILIEARIZE_H_
+#define RECTILIEARIZE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The library is built with -fvisibility=hidden, only the functions declared here are exported from the shared library.
+// The single header build/rectilinearize.h makes them static instead when RECTILINEARIZE_STATIC is defined
+#if defined(RECTILINEARIZE_STATIC) && (defined(__GNUC__) || defined(__clang__))
+#	define RECTILINEARIZE_API static __attribute__((unused))
+#elif defined(RECTILINEARIZE_STATIC)
+#	define RECTILINEARIZE_API static
+#elif defined(__GNUC__) || defined(__clang__)
+#	define RECTILINEARIZE_API __attribute__((visibility("default")))
+#else
+#	define RECTILINEARIZE_API
+#endif
+
+// librectilinearize.a and librectilinearize.so contain the extractor together with the stb_image, stb_ds and nobuild
+// code it uses, so programs link the library and -lm and nothing else. The stb_ds inside them is renamed and allocates
+// through the allocator of `rectilinearize_set_allocator`, so it never mixes with another stb_ds of the program. A
+// program that compiles its own stb_image into itself has the static library decode with that copy instead.
+
+/**
+ * @brief Converts an image represented by an array of RGBA values to rectilinear polygon.
+ *
+ * This function takes the input image data and creates a rectilinear polygon representing the contents of the
+ * image. The image *MUST* have a fully transperent background.
+ *
+ * @param data A pointer to the array of RGBA values representing the input image.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param points A pointer to an array of XY values representing the vertices of the rectilinear polygon. This array
+ *               will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the length of the points array.
+ *
+ * @note The 'data' array is expected to be in RGBA format, where each pixel is represented by four consecutive
+ *       unsigned char values: red, green, blue, and alpha channels.
+ * @note The 'points' array is an even length array where every two elements is a pair of X-Y coordinates.
+ */
+RECTILINEARIZE_API void rectilinearize_image(unsigned char *data, int width, int height, int **points, size_t *point_count);
+
+/**
+ * @brief Converts a rectangular region of a larger RGBA image to a rectilinear polygon.
+ *
+ * Works like `rectilinearize_image` on the 'width' x 'height' pixels starting at 'data', where consecutive rows are
+ * 'stride' pixels apart. This allows extracting e.g. a single cell of a sprite atlas without copying it.
+ *
+ * @param data A pointer to the top left pixel of the region.
+ * @param width The width of the region.
+ * @param height The height of the region.
+ * @param stride The width of the whole image, i.e. the number of pixels between the start of two rows.
+ * @param points A pointer to an array of XY values relative to the region. This array will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the length of the points array.
+ *
+ * @note The result cache is only used when 'stride' equals 'width'.
+ */
+RECTILINEARIZE_API void rectilinearize_image_view(unsigned char *data, int width, int height, int stride, int **points, size_t *point_count);
+
+/**
+ * @brief Converts an image represented by an array of RGBA values to rectilinear polygon.
+ *
+ * This function takes the path to png image and creates a rectilinear polygon representing the contents of the
+ * image. The image *MUST* have a fully transperent background.
+ *
+ * @param filename Path to a png file.
+ * @param points A pointer to an array of XY values representing the vertices of the rectilinear polygon. This array
+ *               will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the length of the points array.
+ *
+ * @note The 'filename' string must point to a valid png file with an alpha channel
+ * @note The 'points' array is an even length array where every two elements is a pair of X-Y coordinates.
+ */
+RECTILINEARIZE_API void rectilinearize_file(const char *filename, int **points, size_t *point_count);
+
+/**
+ * @brief Where the time of an extraction went.
+ *
+ * Filled by `rectilinearize_image_stats` and `rectilinearize_file_stats`. Every field is added to, so the same struct
+ * can collect the totals of many extractions. Timings are measured with a monotonic clock. When the library is built
+ * with RECTILINEARIZE_NO_STATS the instrumentation is compiled out and the struct is left untouched.
+ */
+typedef struct {
+	uint64_t decode_ns;       // Decoding the png, only measured by `rectilinearize_file_stats`
+	uint64_t scan_ns;         // Scanning the pixels for corners
+	uint64_t sort_y_ns;       // Sorting the corners by row
+	uint64_t sort_x_ns;       // Sorting the corners by column
+	uint64_t edges_ns;        // Building the hash maps of horizontal and vertical edges
+	uint64_t walk_ns;         // Walking the edges to put the vertices in order
+
+	uint64_t pixels;          // Pixels scanned
+	uint64_t corners;         // Corners found
+	uint64_t edges;           // Horizontal and vertical edges
+	uint64_t hash_probes;     // Insertions into and lookups in the edge hash maps
+	uint64_t bytes_allocated; // Bytes allocated for the corner, edge and vertex arrays
+	uint64_t allocations;     // Calls to the allocator of `rectilinearize_set_allocator` by the extracting thread
+	uint64_t peak_bytes;      // Largest amount of memory held at once through that allocator, kept as a maximum
+} RectilinearizeStats;
+
+/**
+ * @brief Works like `rectilinearize_image` and adds the timings and counters of the extraction to 'stats'.
+ *
+ * @note The result cache is never used, so the numbers always describe a full extraction.
+ */
+RECTILINEARIZE_API void rectilinearize_image_stats(unsigned char *data, int width, int height, int **points, size_t *point_count, RectilinearizeStats *stats);
+
+/**
+ * @brief Works like `rectilinearize_file` and adds the timings and counters of decoding and extraction to 'stats'.
+ *
+ * @note The result cache is never used, so the numbers always describe a full extraction.
+ */
+RECTILINEARIZE_API void rectilinearize_file_stats(const char *filename, int **points, size_t *point_count, RectilinearizeStats *stats);
+
+/**
+ * @brief The stages reported to a `RectilinearizeStageHook`, in the order they run.
+ */
+typedef enum {
+	RECTILINEARIZE_STAGE_NONE,   // Outside of any stage, reported once an extraction finished
+	RECTILINEARIZE_STAGE_DECODE,
+	RECTILINEARIZE_STAGE_SCAN,
+	RECTILINEARIZE_STAGE_SORT_Y,
+	RECTILINEARIZE_STAGE_SORT_X,
+	RECTILINEARIZE_STAGE_EDGES,  // Reported twice per extraction, once for each axis
+	RECTILINEARIZE_STAGE_WALK,
+	RECTILINEARIZE_STAGE_COUNT,
+} RectilinearizeStage;
+
+typedef void (*RectilinearizeStageHook)(RectilinearizeStage stage, void *user);
+
+/**
+ * @brief Sets a function called whenever `rectilinearize_image_stats` or `rectilinearize_file_stats` enters a stage.
+ *
+ * Everything that happened between two calls belongs to the stage of the first one, which lets a caller attribute its
+ * own measurements, such as hardware performance counters, to the stages. The hook runs on the extracting thread
+ * between two readings of the clock, so its own cost ends up in the timings of `RectilinearizeStats`.
+ *
+ * @param hook The function to call, or NULL to remove the hook.
+ * @param user Passed on to every call of 'hook'.
+ *
+ * @note Not thread-safe, has to be called while no extraction is running.
+ */
+RECTILINEARIZE_API void rectilinearize_set_stage_hook(RectilinearizeStageHook hook, void *user);
+
+/**
+ * @brief The functions every allocation of the vendored stb_ds and stb_image goes through.
+ *
+ * 'realloc' has the semantics of the C function of the same name and is called with a NULL 'ptr' to allocate a new
+ * block. 'free' is never called with NULL.
+ */
+typedef struct {
+	void *(*realloc)(void *user, void *ptr, size_t size);
+	void (*free)(void *user, void *ptr);
+	void *user;
+} RectilinearizeAllocator;
+
+/**
+ * @brief Replaces the allocator used for decoded images, corner arrays and edge maps.
+ *
+ * The library keeps its allocation counters on top of any allocator, so they are always available through
+ * `rectilinearize_alloc_stats`. Memory the library hands to the caller, such as the vertex arrays, is still allocated
+ * with `malloc` and has to be freed with `free`.
+ *
+ * @param allocator The allocator to copy, or NULL to go back to `realloc` and `free`.
+ *
+ * @note Not thread-safe, has to be called before any other function of the library is used.
+ */
+RECTILINEARIZE_API void rectilinearize_set_allocator(const RectilinearizeAllocator *allocator);
+
+/**
+ * @brief Totals of every allocation made by the library since it was loaded or since `rectilinearize_alloc_stats_reset`.
+ */
+typedef struct {
+	uint64_t allocations;       // Blocks allocated
+	uint64_t reallocations;     // Blocks resized
+	uint64_t frees;             // Blocks freed
+	uint64_t bytes_allocated;   // Bytes requested by allocations and by growing reallocations
+	uint64_t bytes_in_use;      // Bytes allocated and not freed yet, memory that leaked stays in here
+	uint64_t peak_bytes_in_use; // Largest value 'bytes_in_use' reached
+} RectilinearizeAllocStats;
+
+/**
+ * @brief Reads the allocation counters of the library, which are shared by every thread.
+ */
+RECTILINEARIZE_API void rectilinearize_alloc_stats(RectilinearizeAllocStats *stats);
+
+/**
+ * @brief Sets every counter back to zero and the peak to the bytes currently in use.
+ */
+RECTILINEARIZE_API void rectilinearize_alloc_stats_reset(void);
+
+/**
+ * @brief A polygon that can be updated after parts of its image changed, see `rectilinearize_result_create`.
+ */
+typedef struct RectilinearizeResult RectilinearizeResult;
+
+/**
+ * @brief Extracts the polygon of an RGBA image and keeps what is needed to update it incrementally.
+ *
+ * Works like `rectilinearize_image`, but also keeps the corner pixels of the image and the edges between them, so
+ * `rectilinearize_result_update` only has to rescan the pixels that changed instead of the whole image.
+ *
+ * @param data A pointer to an array of RGBA values representing the image.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ *
+ * @return A handle that has to be freed with `rectilinearize_result_free`, or NULL if it could not be allocated.
+ */
+RECTILINEARIZE_API RectilinearizeResult *rectilinearize_result_create(unsigned char *data, int width, int height);
+
+/**
+ * @brief Updates the polygon after the pixels in a rectangle of the image changed.
+ *
+ * Only the changed rectangle plus a one pixel border is scanned again. The corners found there replace the old ones,
+ * and only the edges of the rows and columns that were scanned are paired up again. The polygon is then walked again
+ * from its first corner, so an update still costs a walk over every vertex of the polygon.
+ *
+ * @param result A handle returned by `rectilinearize_result_create`.
+ * @param data A pointer to the RGBA values of the whole image after the change, the same size as when 'result' was
+ *             created.
+ * @param x The left edge of the changed rectangle.
+ * @param y The top edge of the changed rectangle.
+ * @param width The width of the changed rectangle.
+ * @param height The height of the changed rectangle.
+ */
+RECTILINEARIZE_API void rectilinearize_result_update(RectilinearizeResult *result, unsigned char *data, int x, int y, int width, int height);
+
+/**
+ * @brief Returns the current polygon of 'result'.
+ *
+ * @param result A handle returned by `rectilinearize_result_create`.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices.
+ *
+ * @return An array of XY values owned by 'result'. It stays valid until the next update of 'result'.
+ */
+RECTILINEARIZE_API const int *rectilinearize_result_points(const RectilinearizeResult *result, size_t *point_count);
+
+RECTILINEARIZE_API void rectilinearize_result_free(RectilinearizeResult *result);
+
+/**
+ * @brief Enables the on-disk result cache.
+ *
+ * Once enabled, `rectilinearize_image` looks up every result under a hash of the decoded pixels and
+ * `rectilinearize_file` first under a hash of the raw file bytes, so an input that was seen before is neither decoded
+ * nor scanned again. Every entry is a single file in the binary polygon format, named after its key.
+ *
+ * @param dir Path to an existing directory holding the cache entries, or NULL to disable the cache.
+ *
+ * @note Not thread-safe, has to be called before any other function of the library is used.
+ * @note The cache is only available on POSIX systems. On Windows this does nothing, and loading from or storing into
+ *       the cache never finds or writes anything.
+ */
+RECTILINEARIZE_API void rectilinearize_set_cache_dir(const char *dir);
+
+/**
+ * @brief Computes the cache key of a png file from its raw contents.
+ *
+ * @param data A pointer to the contents of the file.
+ * @param size The size of 'data' in bytes.
+ */
+RECTILINEARIZE_API uint64_t rectilinearize_cache_key(const unsigned char *data, size_t size);
+
+/**
+ * @brief Looks up the polygon stored under 'key' in the result cache.
+ *
+ * @param key A key returned by `rectilinearize_cache_key`.
+ * @param points A pointer to an array of XY values that will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices in 'points'.
+ * @param width If not NULL, set to the width of the source image.
+ * @param height If not NULL, set to the height of the source image.
+ *
+ * @return false if the cache is disabled or has no valid entry for 'key'.
+ */
+RECTILINEARIZE_API bool rectilinearize_cache_load(uint64_t key, int **points, size_t *point_count, int *width, int *height);
+
+/**
+ * @brief Stores a polygon under 'key' in the result cache. Does nothing if the cache is disabled.
+ *
+ * @note Entries are written to a temporary file and renamed into place, so several processes can share a cache
+ *       directory.
+ */
+RECTILINEARIZE_API void rectilinearize_cache_store(uint64_t key, const int *points, size_t point_count, int width, int height);
+
+#define RECTILINEARIZE_BIN_MAGIC   "RPLY"
+#define RECTILINEARIZE_BIN_VERSION 1
+
+// Set in `RectilinearizeBinHeader.flags` when the coordinates are stored as uint16 instead of int32
+#define RECTILINEARIZE_BIN_U16 (1 << 0)
+
+/**
+ * @brief Header of the binary polygon format.
+ *
+ * The file is laid out as the header, followed by `uint32_t ring_sizes[ring_count]` holding the number of vertices of
+ * every ring, followed by the XY pairs of all the rings back to back. Every field is little-endian and every section
+ * is 4 byte aligned, so on little-endian machines a `mmap`ed file can be used in place:
+ *
+ *     const RectilinearizeBinHeader *header = map;
+ *     const uint32_t *ring_sizes = (const uint32_t *) (header + 1);
+ *     const int32_t *coords = (const int32_t *) (ring_sizes + header->ring_count); // uint16_t with RECTILINEARIZE_BIN_U16
+ */
+typedef struct {
+	char magic[4];       // RECTILINEARIZE_BIN_MAGIC
+	uint16_t version;    // RECTILINEARIZE_BIN_VERSION
+	uint16_t flags;      // RECTILINEARIZE_BIN_* flags
+	uint32_t width;      // Width of the source image
+	uint32_t height;     // Height of the source image
+	uint32_t ring_count; // Number of rings in the polygon
+} RectilinearizeBinHeader;
+
+/**
+ * @brief Encodes a polygon in the binary polygon format.
+ *
+ * @param points An array of XY values as returned by `rectilinearize_image`.
+ * @param point_count The number of vertices in 'points'.
+ * @param width The width of the source image.
+ * @param height The height of the source image.
+ * @param out Buffer the encoded polygon is written to, or NULL to only compute the size.
+ *
+ * @return The size of the encoded polygon in bytes.
+ *
+ * @note Coordinates are stored as uint16 whenever the image is small enough.
+ */
+RECTILINEARIZE_API size_t rectilinearize_bin_encode(const int *points, size_t point_count, int width, int height, unsigned char *out);
+
+/**
+ * @brief Decodes a polygon stored in the binary polygon format.
+ *
+ * @param data A pointer to the encoded polygon.
+ * @param size The size of 'data' in bytes.
+ * @param points A pointer to an array of XY values that will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices in 'points'.
+ * @param width If not NULL, set to the width of the source image.
+ * @param height If not NULL, set to the height of the source image.
+ *
+ * @return false if 'data' is not a valid binary polygon.
+ */
+RECTILINEARIZE_API bool rectilinearize_bin_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height);
+
+#define RECTILINEARIZE_VARINT_MAGIC   "RPLV"
+#define RECTILINEARIZE_VARINT_VERSION 1
+
+/**
+ * @brief Encodes a polygon as a delta + varint stream.
+ *
+ * Every edge of a rectilinear polygon moves along a single axis and consecutive edges alternate between the axes, so
+ * after the first vertex each vertex only costs one zigzag encoded LEB128 varint holding the delta along the axis
+ * that changed. The stream is laid out as the magic RECTILINEARIZE_VARINT_MAGIC followed by varints:
+ *
+ *     version, width, height, ring_count,
+ *     for every ring: (vertex_count << 1 | first edge is vertical), x, y, delta[vertex_count - 1]
+ *
+ * The closing edge of every ring is implied.
+ *
+ * @param points An array of XY values as returned by `rectilinearize_image`.
+ * @param point_count The number of vertices in 'points'.
+ * @param width The width of the source image.
+ * @param height The height of the source image.
+ * @param out Buffer the encoded polygon is written to, or NULL to only compute the size.
+ *
+ * @return The size of the encoded polygon in bytes, or 0 if the edges of the polygon do not alternate between the
+ *         axes.
+ */
+RECTILINEARIZE_API size_t rectilinearize_varint_encode(const int *points, size_t point_count, int width, int height, unsigned char *out);
+
+/**
+ * @brief Decodes a polygon stored as a delta + varint stream.
+ *
+ * @param data A pointer to the encoded polygon.
+ * @param size The size of 'data' in bytes.
+ * @param points A pointer to an array of XY values that will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices in 'points'.
+ * @param width If not NULL, set to the width of the source image.
+ * @param height If not NULL, set to the height of the source image.
+ *
+ * @return false if 'data' is not a valid delta + varint stream.
+ */
+RECTILINEARIZE_API bool rectilinearize_varint_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height);
+
+#endif  // RECTILIEARIZE_H_
+
+#ifdef RECTILINEARIZE_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// Only the result cache needs these, it is compiled out on Windows
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Has to come before the stb headers so their allocations are tracked
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+
+// Routes every allocation of stb_ds and stb_image through the allocator set with `rectilinearize_set_allocator`, which
+// also keeps the counters of `rectilinearize_alloc_stats`. nobuild force includes this into the stb implementations.
+// Every other file has to include it before stb_ds.h, because the stb_ds macros free memory in the including file.
+void *rectilinearize_alloc_realloc(void *ptr, size_t size);
+void rectilinearize_alloc_free(void *ptr);
+
+// The stb_ds functions get names of their own, so a program that links another stb_ds next to the libraries never
+// mixes it with this one. Its arrays would be freed at the wrong address by the inline macros of the other.
+#define stbds_rand_seed     rectilinearize__stbds_rand_seed
+#define stbds_hash_bytes    rectilinearize__stbds_hash_bytes
+#define stbds_hash_string   rectilinearize__stbds_hash_string
+#define stbds_stralloc      rectilinearize__stbds_stralloc
+#define stbds_strreset      rectilinearize__stbds_strreset
+#define stbds_unit_tests    rectilinearize__stbds_unit_tests
+#define stbds_arrgrowf      rectilinearize__stbds_arrgrowf
+#define stbds_arrfreef      rectilinearize__stbds_arrfreef
+#define stbds_hmfree_func   rectilinearize__stbds_hmfree_func
+#define stbds_hmget_key     rectilinearize__stbds_hmget_key
+#define stbds_hmget_key_ts  rectilinearize__stbds_hmget_key_ts
+#define stbds_hmput_default rectilinearize__stbds_hmput_default
+#define stbds_hmput_key     rectilinearize__stbds_hmput_key
+#define stbds_hmdel_key     rectilinearize__stbds_hmdel_key
+#define stbds_shmode_func   rectilinearize__stbds_shmode_func
+
+#define STBDS_REALLOC(context, ptr, size) rectilinearize_alloc_realloc(ptr, size)
+#define STBDS_FREE(context, ptr)          rectilinearize_alloc_free(ptr)
+
+#define STBI_MALLOC(size)       rectilinearize_alloc_realloc(NULL, size)
+#define STBI_REALLOC(ptr, size) rectilinearize_alloc_realloc(ptr, size)
+#define STBI_FREE(ptr)          rectilinearize_alloc_free(ptr)
+
+// stb_ds seeds every new hash map from a single global seed, which it advances without any synchronization. A map is
+// created by its first insert, so maps that may be filled on several threads at once are filled with `hmput_locked`.
+// A lookup on an empty map already allocates the map, but its hash table is still only built by the first insert.
+void rectilinearize_hash_lock(void);
+void rectilinearize_hash_unlock(void);
+
+#define hmput_locked(map, key, value)                                 \
+	do {                                                              \
+		if ((map) == NULL || stbds_header(map)->hash_table == NULL) { \
+			rectilinearize_hash_lock();                               \
+			hmput(map, key, value);                                   \
+			rectilinearize_hash_unlock();                             \
+		} else {                                                      \
+			hmput(map, key, value);                                   \
+		}                                                             \
+	} while (0)
+
+#endif // ALLOC_H_
+
+#include <stb_image.h>
+#include <stb_ds.h>
+
+#ifndef TODO
+#	define TODO(fmt, ...) (fprintf(stderr, "[TODO] %s:%d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__), exit(1))
+#endif
+
+
+typedef struct {
+	unsigned char *data; // Pointer to the RGBA array
+	int width;           // Width of the image
+	int height;          // Height of the image
+	int channels;        // Number of channels in the image
+	int stride;          // Number of pixels from the start of one row to the next, equal to 'width' unless the image is a view
+} Image;
+
+#define INDEX_IMG(i, x, y) (i.stride * y + x) * i.channels
+#define INDEX_IMGP(i, x, y) (i->stride * y + x) * i->channels
+
+// Building with RECTILINEARIZE_NO_STATS turns every `STATS_ON` check into a constant, so the instrumentation is
+// removed entirely by the compiler
+#ifndef RECTILINEARIZE_NO_STATS
+#define STATS_ON(stats) ((stats) != NULL)
+#else
+#define STATS_ON(stats) false
+#endif
+
+static uint64_t stats_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Every block handed out to stb_ds and stb_image starts with its size, so a free knows how many bytes it releases.
+// The header is as large as the strictest alignment to keep the block behind it aligned
+#define ALLOC_HEADER_SIZE _Alignof(max_align_t)
+
+static RectilinearizeAllocator allocator;
+
+static atomic_uint_fast64_t alloc_count;
+static atomic_uint_fast64_t realloc_count;
+static atomic_uint_fast64_t free_count;
+static atomic_uint_fast64_t alloc_bytes;
+static atomic_uint_fast64_t alloc_in_use;
+static atomic_uint_fast64_t alloc_peak;
+
+// The same counters for the current thread only, so the stats entry points can tell what a single extraction used
+static _Thread_local struct {
+	uint64_t calls;
+	int64_t in_use;   // Goes negative when this thread frees memory allocated by another one
+	int64_t peak;
+} thread_alloc;
+
+void rectilinearize_set_allocator(const RectilinearizeAllocator *a) {
+	allocator = a != NULL ? *a : (RectilinearizeAllocator) {0};
+}
+
+static void alloc_account(atomic_uint_fast64_t *counter, size_t old_size, size_t new_size) {
+	atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+	if (new_size >= old_size) {
+		uint64_t grown = new_size - old_size;
+		atomic_fetch_add_explicit(&alloc_bytes, grown, memory_order_relaxed);
+		uint64_t in_use = atomic_fetch_add_explicit(&alloc_in_use, grown, memory_order_relaxed) + grown;
+		uint64_t peak = atomic_load_explicit(&alloc_peak, memory_order_relaxed);
+		while (in_use > peak && !atomic_compare_exchange_weak_explicit(&alloc_peak, &peak, in_use, memory_order_relaxed, memory_order_relaxed)) {
+		}
+	} else {
+		atomic_fetch_sub_explicit(&alloc_in_use, old_size - new_size, memory_order_relaxed);
+	}
+
+	thread_alloc.calls += 1;
+	thread_alloc.in_use += (int64_t) new_size - (int64_t) old_size;
+	if (thread_alloc.in_use > thread_alloc.peak) {
+		thread_alloc.peak = thread_alloc.in_use;
+	}
+}
+
+void *rectilinearize_alloc_realloc(void *ptr, size_t size) {
+	unsigned char *block = NULL;
+	size_t old_size = 0;
+	if (ptr != NULL) {
+		block = (unsigned char *) ptr - ALLOC_HEADER_SIZE;
+		memcpy(&old_size, block, sizeof old_size);
+	}
+	if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+		return NULL;
+	}
+
+	unsigned char *fresh = allocator.realloc != NULL
+		? allocator.realloc(allocator.user, block, size + ALLOC_HEADER_SIZE)
+		: realloc(block, size + ALLOC_HEADER_SIZE);
+	if (fresh == NULL) {
+		return NULL;
+	}
+
+	memcpy(fresh, &size, sizeof size);
+	alloc_account(ptr != NULL ? &realloc_count : &alloc_count, old_size, size);
+	return fresh + ALLOC_HEADER_SIZE;
+}
+
+void rectilinearize_alloc_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	unsigned char *block = (unsigned char *) ptr - ALLOC_HEADER_SIZE;
+	size_t size;
+	memcpy(&size, block, sizeof size);
+	alloc_account(&free_count, size, 0);
+	if (allocator.free != NULL) {
+		allocator.free(allocator.user, block);
+	} else {
+		free(block);
+	}
+}
+
+void rectilinearize_alloc_stats(RectilinearizeAllocStats *stats) {
+	*stats = (RectilinearizeAllocStats) {
+		.allocations = atomic_load_explicit(&alloc_count, memory_order_relaxed),
+		.reallocations = atomic_load_explicit(&realloc_count, memory_order_relaxed),
+		.frees = atomic_load_explicit(&free_count, memory_order_relaxed),
+		.bytes_allocated = atomic_load_explicit(&alloc_bytes, memory_order_relaxed),
+		.bytes_in_use = atomic_load_explicit(&alloc_in_use, memory_order_relaxed),
+		.peak_bytes_in_use = atomic_load_explicit(&alloc_peak, memory_order_relaxed),
+	};
+}
+
+void rectilinearize_alloc_stats_reset(void) {
+	atomic_store_explicit(&alloc_count, 0, memory_order_relaxed);
+	atomic_store_explicit(&realloc_count, 0, memory_order_relaxed);
+	atomic_store_explicit(&free_count, 0, memory_order_relaxed);
+	atomic_store_explicit(&alloc_bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&alloc_peak, atomic_load_explicit(&alloc_in_use, memory_order_relaxed), memory_order_relaxed);
+}
+
+// Creating a hash map is rare and short, so a spin lock is enough
+static atomic_flag hash_lock = ATOMIC_FLAG_INIT;
+
+void rectilinearize_hash_lock(void) {
+	while (atomic_flag_test_and_set_explicit(&hash_lock, memory_order_acquire)) {
+	}
+}
+
+void rectilinearize_hash_unlock(void) {
+	atomic_flag_clear_explicit(&hash_lock, memory_order_release);
+}
+
+// Marks the start of an extraction on this thread, see `thread_alloc_end`
+static int64_t thread_alloc_begin(void) {
+	thread_alloc.peak = thread_alloc.in_use;
+	return thread_alloc.in_use;
+}
+
+static void thread_alloc_end(RectilinearizeStats *stats, uint64_t calls, int64_t in_use) {
+	stats->allocations += thread_alloc.calls - calls;
+	uint64_t peak = (uint64_t) (thread_alloc.peak - in_use);
+	if (peak > stats->peak_bytes) {
+		stats->peak_bytes = peak;
+	}
+}
+
+static RectilinearizeStageHook stage_hook;
+static void *stage_hook_user;
+
+void rectilinearize_set_stage_hook(RectilinearizeStageHook hook, void *user) {
+	stage_hook = hook;
+	stage_hook_user = user;
+}
+
+// Reads the clock at the boundary of two stages and tells the stage hook which one starts
+static uint64_t stats_enter(RectilinearizeStage stage) {
+	uint64_t now = stats_clock();
+	if (stage_hook != NULL) {
+		stage_hook(stage, stage_hook_user);
+	}
+	return now;
+}
+
+static bool is_corner_pixel(const Image *img, int x, int y) {
+	int w = img->width;
+	int h = img->height;
+
+	// Calculate ahead of time to simplify the conditions
+	bool is_trans_top          = (y > 0)              ? (img->data[INDEX_IMGP(img,     x, (y-1)) + 3] == 0) : true;
+	bool is_trans_bottom       = (y < h-1)            ? (img->data[INDEX_IMGP(img,     x, (y+1)) + 3] == 0) : true;
+
+	bool is_trans_left         = (x > 0)              ? (img->data[INDEX_IMGP(img, (x-1),     y) + 3] == 0) : true;
+	bool is_trans_right        = (x < w-1)            ? (img->data[INDEX_IMGP(img, (x+1),     y) + 3] == 0) : true;
+
+	bool is_trans_top_left     = (x > 0 && y > 0)     ? (img->data[INDEX_IMGP(img, (x-1), (y-1)) + 3] == 0) : true;
+	bool is_trans_top_right    = (x < w-1 && y > 0)   ? (img->data[INDEX_IMGP(img, (x+1), (y-1)) + 3] == 0) : true;
+
+	bool is_trans_bottom_left  = (x > 0 && y < h-1)   ? (img->data[INDEX_IMGP(img, (x-1), (y+1)) + 3] == 0) : true;
+	bool is_trans_bottom_right = (x < w-1 && y < h-1) ? (img->data[INDEX_IMGP(img, (x+1), (y+1)) + 3] == 0) : true;
+
+	// Edge case 1: The Pixel is protruding from the image. That means that the pixel is only connected on main side with
+	// the 2 diagnoal sides being non transparent. i.e tetris T block eg:
+	//
+	//     +---+---+---+
+	//     |   |   |   |
+	//     +---+---+---+
+	//     | 0 | * | 0 |
+	//     +---+---+---+
+	//     | 0 | 0 | 0 |
+	//     +---+---+---+
+	//
+	if ((!is_trans_top_left && !is_trans_top && !is_trans_top_right && is_trans_right && is_trans_bottom_right && is_trans_bottom && is_trans_bottom_left && is_trans_left)
+		|| (!is_trans_top_right && !is_trans_right && !is_trans_bottom_right && is_trans_bottom && is_trans_bottom_left && is_trans_left && is_trans_top_left && is_trans_top)
+		|| (!is_trans_bottom_right && !is_trans_bottom && !is_trans_bottom_left && is_trans_left && is_trans_top_left && is_trans_top && is_trans_top_right && is_trans_right)
+		|| (!is_trans_bottom_left && !is_trans_left && !is_trans_top_left && is_trans_top && is_trans_top_right && is_trans_right && is_trans_bottom_right && is_trans_bottom)) {
+		TODO("Fucking deal with this edge case: { x: %d, y: %d }\n", x, y);
+	}
+
+	// Check for convex corner pixels. A convex corner pixel must have atleast 3 neighbors be transparent and the
+	// neighbors must be adjacent to one another and one of them must be a diagonal pixel. eg:
+	//
+	//     +---+---+---+
+	//     | 0 | 0 |   |
+	//     +---+---+---+
+	//     | 0 | * |   |
+	//     +---+---+---+
+	//     |   |   |   |
+	//     +---+---+---+
+	//
+	if ((is_trans_left && is_trans_top_left && is_trans_top)
+		|| (is_trans_top && is_trans_top_right && is_trans_right)
+		|| (is_trans_right && is_trans_bottom_right && is_trans_bottom)
+		|| (is_trans_bottom && is_trans_bottom_left && is_trans_left)) {
+		return true;
+	}
+
+	// Edge Case 2: Do convex corners are infront of each another
+	//
+	//  +---+---+---+---+
+	//  |   |   |   |   |
+	//  +---+---+---+---+
+	//  |   | * | 0 |   |
+	//  +---+---+---+---+
+	//  |   | 0 | * |   |
+	//  +---+---+---+---+
+	//  |   |   |   |   |
+	//  +---+---+---+---+
+	//
+	if ((is_trans_left && !is_trans_top_left && is_trans_top)
+		|| (is_trans_top && !is_trans_top_right && is_trans_right)
+		|| (is_trans_right && !is_trans_bottom_right && is_trans_bottom)
+		|| (is_trans_bottom && !is_trans_bottom_left && is_trans_left)) {
+		return true;
+	}
+
+	// Check for concave corner pixels. A concave corner pixel must have exactly one diagonal neighbor be
+	// transparent. eg:
+	//
+	//     +---+---+---+
+	//     | 0 |   |   |
+	//     +---+---+---+
+	//     |   | * |   |
+	//     +---+---+---+
+	//     |   |   |   |
+	//     +---+---+---+
+	//
+	if ((is_trans_top_left && !is_trans_top && !is_trans_top_right && !is_trans_right && !is_trans_bottom_right && !is_trans_bottom && !is_trans_bottom_left && !is_trans_left)
+		|| (is_trans_top_right && !is_trans_right && !is_trans_bottom_right && !is_trans_bottom && !is_trans_bottom_left && !is_trans_left && !is_trans_top_left && !is_trans_top)
+		|| (is_trans_bottom_right && !is_trans_bottom && !is_trans_bottom_left && !is_trans_left && !is_trans_top_left && !is_trans_top && !is_trans_top_right && !is_trans_right)
+		|| (is_trans_bottom_left && !is_trans_left && !is_trans_top_left && !is_trans_top && !is_trans_top_right && !is_trans_right && !is_trans_bottom_right && !is_trans_bottom)) {
+		return true;
+	}
+
+	return false;
+}
+
+typedef struct RectilinearPoint {
+	int x, y;
+} RectilinearPoint;
+
+// Appends every corner pixel in the rectangle from ('x0', 'y0') up to ('x1', 'y1') to 'points' in scan order
+static void extract_corners(const Image *img, int x0, int y0, int x1, int y1, RectilinearPoint **points) {
+	for(int y = y0; y < y1; y++) {
+		for(int x = x0; x < x1; x++) {
+			// Check if the pixel is transparent
+			if (img->data[INDEX_IMGP(img, x, y) + 3] == 0) {
+				continue;
+			}
+
+			if (is_corner_pixel(img, x, y)) {
+				RectilinearPoint point = { .x = x, .y = y };
+				arrput(*points, point);
+			}
+		}
+	}
+}
+
+static void extract_polygon(Image *img, RectilinearPoint **points) {
+	extract_corners(img, 0, 0, img->width, img->height, points);
+}
+
+typedef struct Edge {
+	RectilinearPoint key, value;
+} Edge;
+
+// Pairs up the corners of every row in 'points', or of every column with 'cmp_by_x', and adds the edges between them
+// to 'map' in both directions. 'points' has to hold whole rows or columns
+static Edge *add_edges(Edge *map, const RectilinearPoint *points, size_t point_count, bool cmp_by_x) {
+	for (size_t i = 0; i < point_count;) {
+		size_t last_idx = point_count;
+		for (size_t j = i; j < point_count; ++j) {
+			if ((cmp_by_x && points[j].x != points[i].x) || (!cmp_by_x && points[j].y != points[i].y)) {
+				last_idx = j;
+				break;
+			}
+		}
+
+		bool in_edge = false;
+		const RectilinearPoint *first_point = NULL;
+		for (size_t j = i; j < last_idx; ++j) {
+			if (in_edge) {
+				hmput_locked(map, *first_point, points[j]);
+				hmput_locked(map, points[j], *first_point);
+				in_edge = false;
+			} else {
+				first_point = points + j;
+				in_edge = true;
+			}
+		}
+
+		i = last_idx;
+	}
+
+	return map;
+}
+
+// Two separate comparators instead of a flag so concurrent calls do not race on shared state
+static int is_less_by_x(const void *_a, const void *_b) {
+	RectilinearPoint a = *((RectilinearPoint *) _a); RectilinearPoint b = *((RectilinearPoint *) _b);
+	return a.x == b.x ? a.y - b.y : a.x - b.x;
+}
+
+static int is_less_by_y(const void *_a, const void *_b) {
+	RectilinearPoint a = *((RectilinearPoint *) _a); RectilinearPoint b = *((RectilinearPoint *) _b);
+	return a.y == b.y ? a.x - b.x : a.y - b.y;
+}
+
+// Directory of the result cache, NULL while caching is disabled
+static char *cache_dir = NULL;
+
+// Seeds that keep keys of raw files and of decoded pixels apart
+#define CACHE_FILE_SEED  0x52504c5946494c45ull
+#define CACHE_PIXEL_SEED 0x52504c5950495845ull
+
+static const uint64_t hash_primes[5] = {
+	0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x85EBCA77C2B2AE63ull, 0x27D4EB2F165667C5ull,
+};
+
+static uint64_t rotl64(uint64_t v, int r) {
+	return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t load_u64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t v) {
+	return rotl64(acc + v * hash_primes[1], 31) * hash_primes[0];
+}
+
+// 64-bit hash in the style of XXH64. Four independent lanes consume 32 bytes per iteration, which hashes a decoded
+// image far faster than it can be scanned.
+static uint64_t hash_bytes(const unsigned char *data, size_t size, uint64_t seed) {
+	const unsigned char *p = data;
+	const unsigned char *end = data + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t lanes[4] = {
+			seed + hash_primes[0] + hash_primes[1], seed + hash_primes[1], seed, seed - hash_primes[0],
+		};
+		for (; end - p >= 32; p += 32) {
+			lanes[0] = hash_round(lanes[0], load_u64(p));
+			lanes[1] = hash_round(lanes[1], load_u64(p + 8));
+			lanes[2] = hash_round(lanes[2], load_u64(p + 16));
+			lanes[3] = hash_round(lanes[3], load_u64(p + 24));
+		}
+
+		h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+		for (int i = 0; i < 4; ++i) {
+			h = (h ^ hash_round(0, lanes[i])) * hash_primes[0] + hash_primes[3];
+		}
+	} else {
+		h = seed + hash_primes[4];
+	}
+
+	h += size;
+	for (; end - p >= 8; p += 8) {
+		h = rotl64(h ^ hash_round(0, load_u64(p)), 27) * hash_primes[0] + hash_primes[3];
+	}
+	for (; p < end; ++p) {
+		h = rotl64(h ^ (*p * hash_primes[4]), 11) * hash_primes[0];
+	}
+
+	h ^= h >> 33;
+	h *= hash_primes[1];
+	h ^= h >> 29;
+	h *= hash_primes[2];
+	h ^= h >> 32;
+	return h;
+}
+
+// Follows the edges from 'start', alternating between a horizontal and a vertical edge, until it is back at 'start'
+static void walk_edges(RectilinearPoint start, Edge *h_edges, Edge *v_edges, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	if (hmlenu(h_edges) == 0 || hmlenu(v_edges) == 0) {
+		return;
+	}
+
+	uint64_t t0 = STATS_ON(stats) ? stats_clock() : 0;
+
+	// Final sorted points
+	RectilinearPoint *sorted_points = NULL;
+	arrput(sorted_points, start);
+
+	bool is_y_axis = true;
+	while (true) {
+		RectilinearPoint next_point;
+		if (is_y_axis) {
+			next_point = hmget(h_edges, arrlast(sorted_points));
+		} else {
+			next_point = hmget(v_edges, arrlast(sorted_points));
+		}
+
+		if (next_point.x == sorted_points[0].x && next_point.y == sorted_points[0].y) {
+			break;
+		}
+
+		arrput(sorted_points, next_point);
+		is_y_axis = !is_y_axis;
+	}
+
+	if (STATS_ON(stats)) {
+		stats->walk_ns += stats_enter(RECTILINEARIZE_STAGE_NONE) - t0;
+		stats->hash_probes += arrlenu(sorted_points);
+		stats->bytes_allocated += sizeof *sorted_points * arrcap(sorted_points) + sizeof(int) * (arrlenu(sorted_points) << 1);
+	}
+
+	if (points && point_count) {
+		size_t p_count = arrlenu(sorted_points);
+		int *p = malloc(sizeof *p * (p_count << 1));
+		if (p == NULL) {
+			arrfree(sorted_points);
+			return;
+		}
+		for (size_t i = 0; i < p_count; ++i) {
+			p[(i << 1)]     = sorted_points[i].x;
+			p[(i << 1) + 1] = sorted_points[i].y;
+		}
+
+		*points = p;
+		*point_count = p_count;
+	}
+
+	arrfree(sorted_points);
+}
+
+// Orders the corners found by `extract_polygon` into the vertices of the polygon. 'corners' is sorted in place
+static void walk_corners(RectilinearPoint *corners, size_t corner_count, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	if (corner_count == 0) {
+		return;
+	}
+
+	RectilinearPoint start = corners[0];
+
+	uint64_t t0 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_SORT_Y) : 0;
+	qsort(corners, corner_count, sizeof *corners, is_less_by_y);
+	uint64_t t1 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_EDGES) : 0;
+	Edge *h_edges = add_edges(NULL, corners, corner_count, false);
+
+	uint64_t t2 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_SORT_X) : 0;
+	qsort(corners, corner_count, sizeof *corners, is_less_by_x);
+	uint64_t t3 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_EDGES) : 0;
+	Edge *v_edges = add_edges(NULL, corners, corner_count, true);
+
+	if (STATS_ON(stats)) {
+		uint64_t t4 = stats_enter(RECTILINEARIZE_STAGE_WALK);
+		stats->sort_y_ns += t1 - t0;
+		stats->sort_x_ns += t3 - t2;
+		stats->edges_ns += (t2 - t1) + (t4 - t3);
+		stats->corners += corner_count;
+		stats->edges += (hmlenu(h_edges) + hmlenu(v_edges)) >> 1;
+		stats->hash_probes += hmlenu(h_edges) + hmlenu(v_edges);
+		stats->bytes_allocated += sizeof(Edge) * (arrcap(h_edges) + arrcap(v_edges));
+	}
+
+	walk_edges(start, h_edges, v_edges, points, point_count, stats);
+	hmfree(h_edges);
+	hmfree(v_edges);
+}
+
+static void extract_points(unsigned char *data, int width, int height, int stride, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	RectilinearPoint *rect_points = NULL;
+
+	Image img = {
+		.data = data, .width = width, .height = height, .channels = 4, .stride = stride
+	};
+	uint64_t start = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_SCAN) : 0;
+	extract_polygon(&img, &rect_points);
+	if (STATS_ON(stats)) {
+		stats->scan_ns += stats_enter(RECTILINEARIZE_STAGE_NONE) - start;
+		stats->pixels += (uint64_t) width * (uint64_t) height;
+		stats->bytes_allocated += sizeof *rect_points * arrcap(rect_points);
+	}
+
+	walk_corners(rect_points, arrlenu(rect_points), points, point_count, stats);
+	arrfree(rect_points);
+}
+
+void rectilinearize_image(unsigned char *data, int width, int height, int **points, size_t *point_count) {
+	if (cache_dir == NULL) {
+		extract_points(data, width, height, width, points, point_count, NULL);
+		return;
+	}
+
+	uint64_t seed = CACHE_PIXEL_SEED ^ ((uint64_t) (uint32_t) width << 32 | (uint32_t) height);
+	uint64_t key = hash_bytes(data, (size_t) width * (size_t) height * 4, seed);
+	int *p = NULL;
+	size_t p_count = 0;
+	if (!rectilinearize_cache_load(key, &p, &p_count, NULL, NULL)) {
+		extract_points(data, width, height, width, &p, &p_count, NULL);
+		rectilinearize_cache_store(key, p, p_count, width, height);
+	}
+
+	if (points && point_count) {
+		*points = p;
+		*point_count = p_count;
+	} else {
+		free(p);
+	}
+}
+
+void rectilinearize_image_view(unsigned char *data, int width, int height, int stride, int **points, size_t *point_count) {
+	// Only contiguous images can be hashed in one go, views skip the cache
+	if (stride == width) {
+		rectilinearize_image(data, width, height, points, point_count);
+	} else {
+		extract_points(data, width, height, stride, points, point_count, NULL);
+	}
+}
+
+void rectilinearize_image_stats(unsigned char *data, int width, int height, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	uint64_t calls = thread_alloc.calls;
+	int64_t in_use = thread_alloc_begin();
+	extract_points(data, width, height, width, points, point_count, stats);
+	if (STATS_ON(stats)) {
+		thread_alloc_end(stats, calls, in_use);
+	}
+}
+
+void rectilinearize_file_stats(const char *filename, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	uint64_t calls = thread_alloc.calls;
+	int64_t in_use = thread_alloc_begin();
+	uint64_t start = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_DECODE) : 0;
+	Image img = {0};
+	img.data = stbi_load(filename, &img.width, &img.height, &img.channels, 4);
+	if (STATS_ON(stats)) {
+		stats->decode_ns += stats_enter(RECTILINEARIZE_STAGE_NONE) - start;
+	}
+	if (img.channels != 4) {
+		stbi_image_free(img.data);
+		return;
+	}
+
+	extract_points(img.data, img.width, img.height, img.width, points, point_count, stats);
+	stbi_image_free(img.data);
+	if (STATS_ON(stats)) {
+		thread_alloc_end(stats, calls, in_use);
+	}
+}
+
+struct RectilinearizeResult {
+	int width;
+	int height;
+	RectilinearPoint *corners;      // Every corner pixel of the image in scan order
+	RectilinearPoint *corners_by_x; // The same corners ordered by column
+	Edge *h_edges;                  // The edges between the corners of every row, kept up to date with 'corners'
+	Edge *v_edges;                  // The edges between the corners of every column, kept up to date with 'corners_by_x'
+	int *points;
+	size_t point_count;
+};
+
+// Rebuilds the polygon by walking the edge maps from the first corner in scan order
+static void result_walk(RectilinearizeResult *result) {
+	free(result->points);
+	result->points = NULL;
+	result->point_count = 0;
+
+	if (arrlenu(result->corners) > 0) {
+		walk_edges(result->corners[0], result->h_edges, result->v_edges, &result->points, &result->point_count, NULL);
+	}
+}
+
+RectilinearizeResult *rectilinearize_result_create(unsigned char *data, int width, int height) {
+	RectilinearizeResult *result = calloc(1, sizeof *result);
+	if (result == NULL) {
+		return NULL;
+	}
+	result->width = width;
+	result->height = height;
+
+	Image img = {
+		.data = data, .width = width, .height = height, .channels = 4, .stride = width
+	};
+	extract_polygon(&img, &result->corners);
+
+	size_t corner_count = arrlenu(result->corners);
+	arrsetlen(result->corners_by_x, corner_count);
+	if (corner_count > 0) {
+		memcpy(result->corners_by_x, result->corners, sizeof *result->corners * corner_count);
+	}
+	qsort(result->corners_by_x, corner_count, sizeof *result->corners_by_x, is_less_by_x);
+	result->h_edges = add_edges(NULL, result->corners, corner_count, false);
+	result->v_edges = add_edges(NULL, result->corners_by_x, corner_count, true);
+	result_walk(result);
+	return result;
+}
+
+// Index of the first corner at or after row 'line', or column 'line' in corners ordered by column with 'by_x'
+static size_t first_corner_of_line(const RectilinearPoint *corners, size_t corner_count, int line, bool by_x) {
+	size_t lo = 0, hi = corner_count;
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) >> 1);
+		if ((by_x ? corners[mid].x : corners[mid].y) < line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Replaces the corners between 'begin' and 'end' that lie within ['lo', 'hi') along the lines with 'fresh', which is
+// in the same order as 'corners'. Corners are ordered by row, or by column with 'by_x'. Returns where the lines end now
+static size_t splice_corners(RectilinearPoint **corners, size_t begin, size_t end, const RectilinearPoint *fresh, size_t fresh_count, int lo, int hi, bool by_x) {
+	int (*cmp)(const void *, const void *) = by_x ? is_less_by_x : is_less_by_y;
+	RectilinearPoint *old = *corners;
+	RectilinearPoint *lines = NULL;
+	arrsetcap(lines, end - begin + fresh_count);
+
+	size_t f = 0;
+	for (size_t i = begin; i < end; ++i) {
+		int along = by_x ? old[i].y : old[i].x;
+		if (along >= lo && along < hi) {
+			continue;
+		}
+		while (f < fresh_count && cmp(&fresh[f], &old[i]) < 0) {
+			arrput(lines, fresh[f++]);
+		}
+		arrput(lines, old[i]);
+	}
+	while (f < fresh_count) {
+		arrput(lines, fresh[f++]);
+	}
+
+	// Only the corners after the lines move, and only when their number changed
+	size_t count = arrlenu(lines);
+	size_t total = arrlenu(old);
+	if (count > end - begin) {
+		arrsetlen(*corners, total + count - (end - begin));
+	}
+	if (count != end - begin && total > end) {
+		memmove(*corners + begin + count, *corners + end, sizeof **corners * (total - end));
+	}
+	if (count < end - begin) {
+		arrsetlen(*corners, total - ((end - begin) - count));
+	}
+	if (count > 0) {
+		memcpy(*corners + begin, lines, sizeof *lines * count);
+	}
+	arrfree(lines);
+	return begin + count;
+}
+
+void rectilinearize_result_update(RectilinearizeResult *result, unsigned char *data, int x, int y, int width, int height) {
+	// Whether a pixel is a corner only depends on its 8 neighbors, so a one pixel halo around the changed pixels covers
+	// every corner that could have appeared or disappeared
+	int x0 = x - 1 > 0 ? x - 1 : 0;
+	int y0 = y - 1 > 0 ? y - 1 : 0;
+	int x1 = x + width + 1 < result->width ? x + width + 1 : result->width;
+	int y1 = y + height + 1 < result->height ? y + height + 1 : result->height;
+	if (width <= 0 || height <= 0 || x0 >= x1 || y0 >= y1) {
+		return;
+	}
+
+	Image img = {
+		.data = data, .width = result->width, .height = result->height, .channels = 4, .stride = result->width
+	};
+	RectilinearPoint *fresh = NULL;
+	extract_corners(&img, x0, y0, x1, y1, &fresh);
+	size_t fresh_count = arrlenu(fresh);
+
+	// Corners are paired up by their position within a row or column, so the edges of every rescanned row and column
+	// are dropped and paired up again once the fresh corners took the place of the old ones
+	size_t corner_count = arrlenu(result->corners);
+	size_t row_begin = first_corner_of_line(result->corners, corner_count, y0, false);
+	size_t row_end = first_corner_of_line(result->corners, corner_count, y1, false);
+	size_t column_begin = first_corner_of_line(result->corners_by_x, corner_count, x0, true);
+	size_t column_end = first_corner_of_line(result->corners_by_x, corner_count, x1, true);
+	for (size_t i = row_begin; i < row_end; ++i) {
+		(void) hmdel(result->h_edges, result->corners[i]);
+	}
+	for (size_t i = column_begin; i < column_end; ++i) {
+		(void) hmdel(result->v_edges, result->corners_by_x[i]);
+	}
+
+	row_end = splice_corners(&result->corners, row_begin, row_end, fresh, fresh_count, x0, x1, false);
+	if (fresh_count > 1) {
+		qsort(fresh, fresh_count, sizeof *fresh, is_less_by_x);
+	}
+	column_end = splice_corners(&result->corners_by_x, column_begin, column_end, fresh, fresh_count, y0, y1, true);
+	arrfree(fresh);
+
+	result->h_edges = add_edges(result->h_edges, result->corners + row_begin, row_end - row_begin, false);
+	result->v_edges = add_edges(result->v_edges, result->corners_by_x + column_begin, column_end - column_begin, true);
+	result_walk(result);
+}
+
+const int *rectilinearize_result_points(const RectilinearizeResult *result, size_t *point_count) {
+	*point_count = result->point_count;
+	return result->points;
+}
+
+void rectilinearize_result_free(RectilinearizeResult *result) {
+	if (result == NULL) {
+		return;
+	}
+	arrfree(result->corners);
+	arrfree(result->corners_by_x);
+	hmfree(result->h_edges);
+	hmfree(result->v_edges);
+	free(result->points);
+	free(result);
+}
+
+// Reads the whole file into memory, the cache key of a file is the hash of its raw bytes
+static unsigned char *read_file(const char *filename, size_t *size) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+
+	unsigned char *data = NULL;
+	long length = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+	if (length > 0 && fseek(f, 0, SEEK_SET) == 0 && (data = malloc((size_t) length)) != NULL) {
+		*size = fread(data, 1, (size_t) length, f);
+		if (*size != (size_t) length) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(f);
+	return data;
+}
+
+void rectilinearize_file(const char *filename, int **points, size_t *point_count) {
+	Image img = {0};
+	if (cache_dir == NULL) {
+		img.data = stbi_load(filename, &img.width, &img.height, &img.channels, 4);
+		if (img.channels != 4) {
+			stbi_image_free(img.data);
+			return;
+		}
+
+		rectilinearize_image(img.data, img.width, img.height, points, point_count);
+		stbi_image_free(img.data);
+		return;
+	}
+
+	size_t size = 0;
+	unsigned char *file = read_file(filename, &size);
+	if (file == NULL || size > INT_MAX) {
+		free(file);
+		return;
+	}
+
+	// Hashing the raw bytes is cheaper than decoding the png, so check those first
+	uint64_t key = rectilinearize_cache_key(file, size);
+	int *p = NULL;
+	size_t p_count = 0;
+	if (!rectilinearize_cache_load(key, &p, &p_count, NULL, NULL)) {
+		img.data = stbi_load_from_memory(file, (int) size, &img.width, &img.height, &img.channels, 4);
+		if (img.channels != 4) {
+			stbi_image_free(img.data);
+			free(file);
+			return;
+		}
+
+		// Only the key of the file is stored, hashing the pixels for a second entry would never pay off
+		extract_points(img.data, img.width, img.height, img.width, &p, &p_count, NULL);
+		stbi_image_free(img.data);
+		rectilinearize_cache_store(key, p, p_count, img.width, img.height);
+	}
+	free(file);
+
+	if (points && point_count) {
+		*points = p;
+		*point_count = p_count;
+	} else {
+		free(p);
+	}
+}
+
+#ifndef _WIN32
+void rectilinearize_set_cache_dir(const char *dir) {
+	free(cache_dir);
+	cache_dir = dir != NULL ? strdup(dir) : NULL;
+}
+#else
+// Entries are mapped and renamed into place with POSIX calls, so the cache stays disabled on Windows
+void rectilinearize_set_cache_dir(const char *dir) {
+	(void) dir;
+}
+#endif
+
+uint64_t rectilinearize_cache_key(const unsigned char *data, size_t size) {
+	return hash_bytes(data, size, CACHE_FILE_SEED);
+}
+
+#ifndef _WIN32
+// Cache entries are named after their key, e.g. "<dir>/0123456789abcdef.bin". NULL when no cache directory is set
+static char *cache_entry_path(uint64_t key) {
+	if (cache_dir == NULL) {
+		return NULL;
+	}
+
+	size_t size = strlen(cache_dir) + 1 + 16 + sizeof ".bin";
+	char *path = malloc(size);
+	if (path != NULL) {
+		snprintf(path, size, "%s/%016llx.bin", cache_dir, (unsigned long long) key);
+	}
+	return path;
+}
+
+bool rectilinearize_cache_load(uint64_t key, int **points, size_t *point_count, int *width, int *height) {
+	char *path = cache_entry_path(key);
+	if (path == NULL) {
+		return false;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0) {
+		return false;
+	}
+
+	bool found = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			found = rectilinearize_bin_decode(map, (size_t) st.st_size, points, point_count, width, height);
+			munmap(map, (size_t) st.st_size);
+		}
+	}
+
+	close(fd);
+	return found;
+}
+
+// Writes 'data' to a temporary file next to 'path' and renames it into place, so concurrent readers and writers of
+// the same cache entry never see a partial file
+static void write_file_atomic(const char *path, const unsigned char *data, size_t size) {
+	char *tmp_path = malloc(strlen(path) + sizeof ".XXXXXX");
+	if (tmp_path == NULL) {
+		return;
+	}
+
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		free(tmp_path);
+		return;
+	}
+	fchmod(fd, 0644); // `mkstemp` creates the file only readable by its owner
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t n = write(fd, data + written, size - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		written += (size_t) n;
+	}
+
+	if (close(fd) != 0 || written != size || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+}
+
+void rectilinearize_cache_store(uint64_t key, const int *points, size_t point_count, int width, int height) {
+	char *path = cache_entry_path(key);
+	if (path == NULL) {
+		return;
+	}
+
+	size_t size = rectilinearize_bin_encode(points, point_count, width, height, NULL);
+	unsigned char *data = malloc(size);
+	if (data != NULL) {
+		rectilinearize_bin_encode(points, point_count, width, height, data);
+		write_file_atomic(path, data, size);
+	}
+
+	free(data);
+	free(path);
+}
+#else
+bool rectilinearize_cache_load(uint64_t key, int **points, size_t *point_count, int *width, int *height) {
+	(void) key;
+	(void) points;
+	(void) point_count;
+	(void) width;
+	(void) height;
+	return false;
+}
+
+void rectilinearize_cache_store(uint64_t key, const int *points, size_t point_count, int width, int height) {
+	(void) key;
+	(void) points;
+	(void) point_count;
+	(void) width;
+	(void) height;
+}
+#endif // _WIN32
+
+static void put_u16_le(unsigned char *p, uint16_t v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+}
+
+static void put_u32_le(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
+}
+
+static uint16_t get_u16_le(const unsigned char *p) {
+	return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32_le(const unsigned char *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+size_t rectilinearize_bin_encode(const int *points, size_t point_count, int width, int height, unsigned char *out) {
+	uint32_t ring_count = point_count > 0 ? 1 : 0;
+	// Vertices lie on pixel boundaries, so a shape touching the right edge of the image has its x equal to 'width'
+	bool is_u16 = width <= UINT16_MAX && height <= UINT16_MAX;
+	size_t coord_size = is_u16 ? sizeof(uint16_t) : sizeof(int32_t);
+
+	// Pad the coordinates so the file stays a multiple of 4 bytes, which keeps concatenated polygons aligned
+	size_t coords_size = ((point_count << 1) * coord_size + 3) & ~(size_t) 3;
+	size_t size = sizeof(RectilinearizeBinHeader) + ring_count * sizeof(uint32_t) + coords_size;
+	if (out == NULL) {
+		return size;
+	}
+
+	memcpy(out, RECTILINEARIZE_BIN_MAGIC, 4);
+	put_u16_le(out + offsetof(RectilinearizeBinHeader, version), RECTILINEARIZE_BIN_VERSION);
+	put_u16_le(out + offsetof(RectilinearizeBinHeader, flags), is_u16 ? RECTILINEARIZE_BIN_U16 : 0);
+	put_u32_le(out + offsetof(RectilinearizeBinHeader, width), (uint32_t) width);
+	put_u32_le(out + offsetof(RectilinearizeBinHeader, height), (uint32_t) height);
+	put_u32_le(out + offsetof(RectilinearizeBinHeader, ring_count), ring_count);
+
+	unsigned char *p = out + sizeof(RectilinearizeBinHeader);
+	if (ring_count > 0) {
+		put_u32_le(p, (uint32_t) point_count);
+		p += sizeof(uint32_t);
+	}
+
+	for (size_t i = 0; i < (point_count << 1); ++i) {
+		if (is_u16) {
+			put_u16_le(p, (uint16_t) points[i]);
+		} else {
+			put_u32_le(p, (uint32_t) points[i]);
+		}
+		p += coord_size;
+	}
+	memset(p, 0, (size_t) (out + size - p));
+
+	return size;
+}
+
+bool rectilinearize_bin_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height) {
+	if (size < sizeof(RectilinearizeBinHeader) || memcmp(data, RECTILINEARIZE_BIN_MAGIC, 4) != 0
+		|| get_u16_le(data + offsetof(RectilinearizeBinHeader, version)) != RECTILINEARIZE_BIN_VERSION) {
+		return false;
+	}
+
+	bool is_u16 = get_u16_le(data + offsetof(RectilinearizeBinHeader, flags)) & RECTILINEARIZE_BIN_U16;
+	size_t coord_size = is_u16 ? sizeof(uint16_t) : sizeof(int32_t);
+	size_t ring_count = get_u32_le(data + offsetof(RectilinearizeBinHeader, ring_count));
+	const unsigned char *p = data + sizeof(RectilinearizeBinHeader);
+	if (ring_count > (size - sizeof(RectilinearizeBinHeader)) / sizeof(uint32_t)) {
+		return false;
+	}
+
+	size_t p_count = 0;
+	for (size_t i = 0; i < ring_count; ++i) {
+		p_count += get_u32_le(p);
+		p += sizeof(uint32_t);
+	}
+
+	if (p_count > (size_t) (data + size - p) / (coord_size << 1)) {
+		return false;
+	}
+
+	int *result = malloc(sizeof *result * ((p_count << 1) > 0 ? (p_count << 1) : 1));
+	if (result == NULL) {
+		return false;
+	}
+
+	for (size_t i = 0; i < (p_count << 1); ++i) {
+		result[i] = is_u16 ? get_u16_le(p) : (int) get_u32_le(p);
+		p += coord_size;
+	}
+
+	*points = result;
+	*point_count = p_count;
+	if (width) {
+		*width = (int) get_u32_le(data + offsetof(RectilinearizeBinHeader, width));
+	}
+	if (height) {
+		*height = (int) get_u32_le(data + offsetof(RectilinearizeBinHeader, height));
+	}
+	return true;
+}
+
+// Writes 'v' as an LEB128 varint into 'out' if it is not NULL and returns the number of bytes it takes
+static size_t put_varint(unsigned char *out, uint64_t v) {
+	size_t n = 0;
+	do {
+		unsigned char byte = (unsigned char) (v & 0x7f);
+		v >>= 7;
+		if (out) {
+			out[n] = byte | (v ? 0x80 : 0);
+		}
+		n += 1;
+	} while (v);
+	return n;
+}
+
+static bool get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+	uint64_t result = 0;
+	for (unsigned shift = 0; shift < 64 && *p < end; shift += 7) {
+		unsigned char byte = *(*p)++;
+		result |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t zigzag_encode(int64_t v) {
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+size_t rectilinearize_varint_encode(const int *points, size_t point_count, int width, int height, unsigned char *out) {
+	size_t ring_count = point_count > 0 ? 1 : 0;
+	bool first_is_vertical = point_count > 1 && points[0] == points[2];
+
+	size_t n = 4;
+	if (out) {
+		memcpy(out, RECTILINEARIZE_VARINT_MAGIC, 4);
+	}
+	n += put_varint(out ? out + n : NULL, RECTILINEARIZE_VARINT_VERSION);
+	n += put_varint(out ? out + n : NULL, (uint64_t) width);
+	n += put_varint(out ? out + n : NULL, (uint64_t) height);
+	n += put_varint(out ? out + n : NULL, ring_count);
+	if (ring_count == 0) {
+		return n;
+	}
+
+	n += put_varint(out ? out + n : NULL, (uint64_t) point_count << 1 | first_is_vertical);
+	n += put_varint(out ? out + n : NULL, (uint64_t) points[0]);
+	n += put_varint(out ? out + n : NULL, (uint64_t) points[1]);
+
+	bool is_vertical = first_is_vertical;
+	for (size_t i = 1; i < point_count; ++i) {
+		int fixed = is_vertical ? points[(i << 1)] - points[(i << 1) - 2] : points[(i << 1) + 1] - points[(i << 1) - 1];
+		if (fixed != 0) {
+			return 0;
+		}
+
+		int64_t delta = is_vertical
+			? (int64_t) points[(i << 1) + 1] - points[(i << 1) - 1]
+			: (int64_t) points[(i << 1)] - points[(i << 1) - 2];
+		n += put_varint(out ? out + n : NULL, zigzag_encode(delta));
+		is_vertical = !is_vertical;
+	}
+
+	return n;
+}
+
+// Walks the rings of a delta + varint stream starting at 'p'. Only counts the vertices when 'out' is NULL
+static bool varint_decode_rings(const unsigned char *p, const unsigned char *end, uint64_t ring_count, int *out, size_t *point_count) {
+	size_t n = 0;
+	for (uint64_t r = 0; r < ring_count; ++r) {
+		uint64_t ring_header, x, y;
+		if (!get_varint(&p, end, &ring_header) || !get_varint(&p, end, &x) || !get_varint(&p, end, &y)
+			|| (ring_header >> 1) == 0 || (ring_header >> 1) - 1 > (uint64_t) (end - p)) {
+			return false;
+		}
+
+		int64_t px = (int64_t) x, py = (int64_t) y;
+		if (out) {
+			out[(n << 1)]     = (int) px;
+			out[(n << 1) + 1] = (int) py;
+		}
+		n += 1;
+
+		bool is_vertical = ring_header & 1;
+		for (uint64_t i = 1; i < (ring_header >> 1); ++i) {
+			uint64_t delta;
+			if (!get_varint(&p, end, &delta)) {
+				return false;
+			}
+
+			if (is_vertical) {
+				py += zigzag_decode(delta);
+			} else {
+				px += zigzag_decode(delta);
+			}
+			if (out) {
+				out[(n << 1)]     = (int) px;
+				out[(n << 1) + 1] = (int) py;
+			}
+			n += 1;
+			is_vertical = !is_vertical;
+		}
+	}
+
+	*point_count = n;
+	return true;
+}
+
+bool rectilinearize_varint_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height) {
+	const unsigned char *p = data + 4;
+	const unsigned char *end = data + size;
+	uint64_t version, w, h, ring_count;
+	if (size < 4 || memcmp(data, RECTILINEARIZE_VARINT_MAGIC, 4) != 0
+		|| !get_varint(&p, end, &version) || version != RECTILINEARIZE_VARINT_VERSION
+		|| !get_varint(&p, end, &w) || !get_varint(&p, end, &h) || !get_varint(&p, end, &ring_count)) {
+		return false;
+	}
+
+	// First pass validates the stream and sizes the output so the second one can decode in place
+	size_t p_count;
+	if (!varint_decode_rings(p, end, ring_count, NULL, &p_count)) {
+		return false;
+	}
+
+	int *xy = malloc(sizeof *xy * ((p_count << 1) > 0 ? (p_count << 1) : 1));
+	if (xy == NULL) {
+		return false;
+	}
+	varint_decode_rings(p, end, ring_count, xy, &p_count);
+
+	*points = xy;
+	*point_count = p_count;
+	if (width) {
+		*width = (int) w;
+	}
+	if (height) {
+		*height = (int) h;
+	}
+	return true;
+}
+
+#endif // RECTILINEARIZE_IMPLEMENTATION
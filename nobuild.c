@@ -23,6 +23,14 @@
 
 #define LIB_DIR "lib"
 
+#define PGO_DIR PATH(BUILD_DIR, "pgo")
+
+#define VERSION_SCRIPT PATH(SRC_DIR, CONCAT("lib", BINARY_NAME, ".map"))
+
+// Names of the shared library, the soname is bumped together with the version node of the version script
+#define SHARED_LIB_NAME CONCAT("lib", BINARY_NAME, ".so.1")
+#define SHARED_LIB_LINK CONCAT("lib", BINARY_NAME, ".so")
+
 // Build macros
 
 #if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
@@ -34,7 +42,27 @@
 #		define EXTRA_CFLAGS "-O2"
 #	endif
 #	define WARNING_FLAGS "-Wall", "-Wextra", "-Wshadow", "-Wconversion", "-Wduplicated-cond", "-Wduplicated-branches", "-Wrestrict", "-Wnull-dereference", "-Wjump-misses-init", "-Wimplicit-fallthrough"
-#	define CFLAGS EXTRA_CFLAGS, WARNING_FLAGS, CONCAT("-I", LIB_DIR), "-lm"
+#	define CFLAGS WARNING_FLAGS, CONCAT("-I", LIB_DIR)
+#	define LDFLAGS "-lm", "-pthread"
+// The objects of the libraries are linked into the shared library, which only exports what main.h marks as
+// RECTILINEARIZE_API and the version script lists
+#	define LIB_CFLAGS "-fPIC", "-fvisibility=hidden"
+#	define SHARED_LDFLAGS "-shared", CONCAT("-Wl,-soname,", SHARED_LIB_NAME), CONCAT("-Wl,--version-script=", VERSION_SCRIPT)
+#
+#	define RELEASE_NATIVE_FLAGS "-O3", "-march=native"
+#	ifdef __clang__
+#		define LTO_FLAGS RELEASE_NATIVE_FLAGS, "-flto=thin"
+#	else
+// Inlining the stb libraries across units exposes stb_ds's unchecked allocations to -Wnull-dereference and a false
+// positive of -Wstringop-overflow in the tga palette lookup of stb_image
+#		define LTO_FLAGS RELEASE_NATIVE_FLAGS, "-flto=auto", "-Wno-null-dereference", "-Wno-stringop-overflow"
+#	endif
+#	define PGO_GENERATE_FLAGS LTO_FLAGS, CONCAT("-fprofile-generate=", PGO_DIR), "-fprofile-update=atomic"
+#	ifdef __clang__
+#		define PGO_USE_FLAGS LTO_FLAGS, CONCAT("-fprofile-use=", PATH(PGO_DIR, "default.profdata"))
+#	else
+#		define PGO_USE_FLAGS LTO_FLAGS, CONCAT("-fprofile-use=", PGO_DIR), "-fprofile-partial-training", "-Wno-missing-profile"
+#	endif
 #elif defined(_MSC_VER)
 #	define CC "cl.exe"
 #
@@ -44,11 +72,94 @@
 #		define EXTRA_CFLAGS "/O2"
 #	endif
 #	define LINKER_FLAGS ""
-#	define CFLAGS EXTRA_CFLAGS,"/W4", CONCAT("/I", LIB_DIR)
+#	define CFLAGS "/W4", CONCAT("/I", LIB_DIR)
+#
+#	define RELEASE_NATIVE_FLAGS "/O2", "/arch:AVX2"
+#	define LTO_FLAGS RELEASE_NATIVE_FLAGS, "/GL"
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Optimization flags of the selected profile, used by every compile and link step
+static Cstr_Array opt_flags;
+
+// Set when 'opt_flags' differ from the flags the build directory was built with, so everything is built again
+static int rebuild_all = 0;
+
+// The flags go last, so a profile can override the warning flags
+#define OPT_CMD(...) cstr_array_concat(CSTR_ARRAY_MAKE(CC, __VA_ARGS__), opt_flags)
+
+static int needs_rebuild(Cstr in_file, Cstr out_file) {
+	return rebuild_all || IS_NEWER(in_file, out_file);
+}
+
+static void run_cmd(Cstr_Array line) {
+	Cmd cmd = { .line = line };
+	INFO("CMD: %s", cmd_show(cmd));
+	cmd_run_sync(cmd);
+}
+
+// Independent build steps run in parallel, at most 'max_jobs' at a time. Jobs are waited for in the order they were
+// started, which is all `pid_wait` allows
+#define MAX_JOBS 256
+static size_t max_jobs = 1;
+static Pid jobs[MAX_JOBS];
+static size_t job_count = 0;
+static size_t jobs_started = 0;
+
+static void jobs_wait(void) {
+	for (size_t i = 0; i < job_count; ++i) {
+		pid_wait(jobs[i]);
+	}
+	job_count = 0;
+}
+
+static void job_start(Cstr_Array line) {
+	if (job_count == max_jobs) {
+		pid_wait(jobs[0]);
+		memmove(jobs, jobs + 1, sizeof *jobs * (job_count - 1));
+		job_count -= 1;
+	}
+
+	Cmd cmd = { .line = line };
+	INFO("CMD: %s", cmd_show(cmd));
+	jobs[job_count++] = cmd_run_async(cmd, NULL, NULL);
+	jobs_started += 1;
+}
+
+static size_t default_jobs(void) {
+#ifndef _WIN32
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (size_t) cpus : 1;
+#else
+	Cstr cpus = getenv("NUMBER_OF_PROCESSORS");
+	return cpus != NULL && atoi(cpus) > 0 ? (size_t) atoi(cpus) : 1;
+#endif
+}
+
+// Remembers the flags of the build in the build directory, so switching profiles never mixes objects of two profiles
+static void use_flags(Cstr_Array flags) {
+	opt_flags = flags;
+	Cstr stamp_file = PATH(BUILD_DIR, "flags");
+	Cstr stamp = cstr_array_join(" ", flags);
+
+	char previous[1024] = {0};
+	FILE *f = fopen(stamp_file, "r");
+	if (f != NULL) {
+		size_t n = fread(previous, 1, sizeof previous - 1, f);
+		previous[n] = '\0';
+		fclose(f);
+	}
+
+	rebuild_all = strcmp(previous, stamp) != 0;
+	if (rebuild_all) {
+		f = fopen(stamp_file, "w");
+		if (f == NULL || fputs(stamp, f) < 0 || fclose(f) != 0) {
+			PANIC("Could not write %s", stamp_file);
+		}
+	}
+}
+
 // LSP stuff
 static void create_ccls_file(Cstr binary_path) {
 	if (IS_NEWER(binary_path, PATH(SRC_DIR, ".ccls"))) {
@@ -56,91 +167,339 @@ static void create_ccls_file(Cstr binary_path) {
 	}
 }
 
-static Cstr build_stb_lib(Cstr lib_file, Cstr impl_macro) {
+// 'track_allocations' routes the allocations of the library through the tracking allocator of src/alloc.h. The object
+// is compiled in the background, `jobs_wait` has to be called before it is used
+static Cstr build_stb_lib(Cstr lib_file, Cstr impl_macro, int track_allocations) {
+	Cstr alloc_header = PATH(SRC_DIR, "alloc.h");
 #if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
 	Cstr out_file = PATH(BUILD_DIR, CONCAT(NOEXT(BASENAME(lib_file)), ".o"));
-	if (IS_NEWER(lib_file, out_file)) {
-		CMD(CC, EXTRA_CFLAGS, CONCAT("-D", impl_macro), "-xc", "-o", out_file, "-c", lib_file);
+	if (needs_rebuild(lib_file, out_file) || (track_allocations && IS_NEWER(alloc_header, out_file))) {
+		if (track_allocations) {
+			job_start(OPT_CMD(LIB_CFLAGS, CONCAT("-D", impl_macro), "-include", alloc_header, "-xc", "-o", out_file, "-c", lib_file));
+		} else {
+			job_start(OPT_CMD(LIB_CFLAGS, CONCAT("-D", impl_macro), "-xc", "-o", out_file, "-c", lib_file));
+		}
 	}
 	return out_file;
 #elif defined(_MSC_VER)
 	Cstr out_file = PATH(BUILD_DIR, CONCAT(NOEXT(BASENAME(lib_file)), ".obj"));
-	if (IS_NEWER(lib_file, out_file)) {
-		CMD(CC, EXTRA_CFLAGS, CONCAT("/D", impl_macro), "/TC", "/Fo:", out_file, "/c", lib_file);
+	if (needs_rebuild(lib_file, out_file) || (track_allocations && IS_NEWER(alloc_header, out_file))) {
+		if (track_allocations) {
+			job_start(OPT_CMD(CONCAT("/D", impl_macro), CONCAT("/FI", alloc_header), "/TC", "/Fo:", out_file, "/c", lib_file));
+		} else {
+			job_start(OPT_CMD(CONCAT("/D", impl_macro), "/TC", "/Fo:", out_file, "/c", lib_file));
+		}
 	}
 	return out_file;
 #endif
 }
 
+static char *read_file(Cstr file) {
+	FILE *f = fopen(file, "rb");
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+		PANIC("Could not read %s", file);
+	}
+	long size = ftell(f);
+	char *contents = malloc((size_t) size + 1);
+	if (size < 0 || contents == NULL || fseek(f, 0, SEEK_SET) != 0 || fread(contents, 1, (size_t) size, f) != (size_t) size) {
+		PANIC("Could not read %s", file);
+	}
+	contents[size] = '\0';
+	fclose(f);
+	return contents;
+}
+
+// Generates the stb style single header: main.h followed by the library part of main.c, which is only compiled where
+// RECTILINEARIZE_IMPLEMENTATION is defined. The allocator header is inlined, the part of main.c behind BINARY and the
+// include of main.h are left out, and the nobuild headers are replaced by the only macro the library uses from them
+static void build_single_header(Cstr out_file) {
+	Cstr header = PATH(SRC_DIR, "main.h");
+	Cstr source = PATH(SRC_DIR, "main.c");
+	Cstr alloc_header = PATH(SRC_DIR, "alloc.h");
+	if (!IS_NEWER(header, out_file) && !IS_NEWER(source, out_file) && !IS_NEWER(alloc_header, out_file)) {
+		return;
+	}
+
+	INFO("GENERATE: %s, %s -> %s", header, source, out_file);
+	FILE *out = fopen(out_file, "wb");
+	if (out == NULL) {
+		PANIC("Could not write %s", out_file);
+	}
+
+	fputs("// rectilinearize.h - single header build of librectilinearize, generated by nobuild from src/main.h and\n"
+	      "// src/main.c. Do not edit.\n"
+	      "//\n"
+	      "// Define RECTILINEARIZE_IMPLEMENTATION in *one* C file before including this file to compile the extractor into\n"
+	      "// it. Define RECTILINEARIZE_STATIC as well to make every function static to that file. The implementation\n"
+	      "// includes stb_image.h and stb_ds.h, defining STB_IMAGE_IMPLEMENTATION and STB_DS_IMPLEMENTATION in the same\n"
+	      "// file compiles them with the allocator of the extractor. Otherwise build/stb_image.o and build/stb_ds.o have\n"
+	      "// to be linked.\n\n", out);
+	fputs(read_file(header), out);
+	fputs("\n#ifdef RECTILINEARIZE_IMPLEMENTATION\n\n", out);
+
+	int nobuild_replaced = 0;
+	char *line = read_file(source);
+	while (*line != '\0' && !STARTS_WITH(line, "#ifdef BINARY")) {
+		char *next = strchr(line, '\n');
+		next = next != NULL ? next + 1 : line + strlen(line);
+
+		if (STARTS_WITH(line, "#include \"alloc.h\"")) {
+			fputs(read_file(alloc_header), out);
+		} else if (STARTS_WITH(line, "#include <nobuild/")) {
+			if (!nobuild_replaced) {
+				fputs("#ifndef TODO\n"
+				      "#\tdefine TODO(fmt, ...) (fprintf(stderr, \"[TODO] %s:%d: \" fmt \"\\n\", __func__, __LINE__, ##__VA_ARGS__), exit(1))\n"
+				      "#endif\n", out);
+				nobuild_replaced = 1;
+			}
+		} else if (!STARTS_WITH(line, "#include \"main.h\"")) {
+			fwrite(line, 1, (size_t) (next - line), out);
+		}
+		line = next;
+	}
+
+	fputs("#endif // RECTILINEARIZE_IMPLEMENTATION\n", out);
+	if (fclose(out) != 0) {
+		PANIC("Could not write %s", out_file);
+	}
+}
+
 // Build the project
 static void build(void) {
 	// Copy and generate necassry source files into intermediate build directory
-	if (!PATH_EXISTS(BUILD_DIR)) {
-		MKDIRS(BUILD_DIR);
+	if (!PATH_EXISTS(PATH(BUILD_DIR, "bin"))) {
+		MKDIRS(PATH(BUILD_DIR, "bin"));
 	}
 
 	Cstr in_file = PATH(SRC_DIR, "main.c");
 	Cstr_Array source_files = CSTR_ARRAY_MAKE(in_file,
-		build_stb_lib(PATH(LIB_DIR, "stb_image.h"), "STB_IMAGE_IMPLEMENTATION"),
-		build_stb_lib(PATH(LIB_DIR, "stb_ds.h"), "STB_DS_IMPLEMENTATION"),
-		build_stb_lib(PATH(LIB_DIR, "nobuild", "nobuild.h"), "NOBUILD_IMPLEMENTATION")
+		PATH(SRC_DIR, "pipeline.c"),
+		PATH(SRC_DIR, "loader.c"),
+		PATH(SRC_DIR, "output.c"),
+		PATH(SRC_DIR, "serve.c"),
+		PATH(SRC_DIR, "writer.c"),
+		PATH(SRC_DIR, "dedup.c"),
+		PATH(SRC_DIR, "trace.c")
 	);
 
-	int should_build_bin = 0;
-	Cstr bin_name = PATH(BUILD_DIR, BINARY_NAME);
+	// Every object is independent of the others, so they are all compiled at once
+	size_t started = jobs_started;
+	Cstr_Array stb_files = CSTR_ARRAY_MAKE(
+		build_stb_lib(PATH(LIB_DIR, "stb_image.h"), "STB_IMAGE_IMPLEMENTATION", 1),
+		build_stb_lib(PATH(LIB_DIR, "stb_ds.h"), "STB_DS_IMPLEMENTATION", 1),
+		build_stb_lib(PATH(LIB_DIR, "nobuild", "nobuild.h"), "NOBUILD_IMPLEMENTATION", 0)
+	);
+	// A copy, appending to the array may move its elements
+	Cstr_Array object_files = cstr_array_concat((Cstr_Array) {0}, stb_files);
+
+	// The binary is compiled with -DBINARY, so its objects are kept apart from the one of the library
 	FOREACH_ARRAY(Cstr , file, source_files, {
-		should_build_bin = should_build_bin || IS_NEWER(*file, bin_name);
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+		Cstr object_file = PATH(BUILD_DIR, "bin", CONCAT(NOEXT(BASENAME(*file)), ".o"));
+		if (needs_rebuild(*file, object_file)) {
+			job_start(OPT_CMD(CFLAGS, "-DBINARY", "-o", object_file, "-c", *file));
+		}
+#elif defined(_MSC_VER)
+		Cstr object_file = PATH(BUILD_DIR, "bin", CONCAT(NOEXT(BASENAME(*file)), ".obj"));
+		if (needs_rebuild(*file, object_file)) {
+			job_start(OPT_CMD(CFLAGS, "/DBINARY", "/Fo:", object_file, "/c", *file));
+		}
+#endif
+		object_files = cstr_array_append(object_files, object_file);
+	});
+	size_t binary_jobs = jobs_started - started;
+
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+	Cstr out_file = PATH(BUILD_DIR, CONCAT(NOEXT(BASENAME(in_file)), ".o"));
+	if (needs_rebuild(in_file, out_file)) {
+		job_start(OPT_CMD(CFLAGS, LIB_CFLAGS, "-o", out_file, "-c", in_file));
+	}
+#elif defined(_MSC_VER)
+	Cstr out_file = PATH(BUILD_DIR, CONCAT(NOEXT(BASENAME(in_file)), ".obj"));
+	if (needs_rebuild(in_file, out_file)) {
+		job_start(OPT_CMD(CFLAGS, "/Fo:", out_file, "/c", in_file));
+	}
+#endif
+	jobs_wait();
+
+	// Objects compiled within the same second as the last link do not look newer, so fresh objects always relink
+	int should_build_bin = binary_jobs > 0;
+	Cstr bin_name = PATH(BUILD_DIR, BINARY_NAME);
+	FOREACH_ARRAY(Cstr , file, object_files, {
+		should_build_bin = should_build_bin || needs_rebuild(*file, bin_name);
 	});
 
 	if (should_build_bin) {
 #if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
-		Cmd build_cmd = {
-			.line = cstr_array_concat(CSTR_ARRAY_MAKE(CC, CFLAGS, "-DBINARY", "-o", bin_name), source_files),
-		};
+		job_start(cstr_array_concat(cstr_array_concat(OPT_CMD("-o", bin_name), object_files), CSTR_ARRAY_MAKE(LDFLAGS)));
 #elif defined(_MSC_VER)
-		Cmd build_cmd = {
-			.line = cstr_array_concat(CSTR_ARRAY_MAKE(CC, CFLAGS, "/DBINARY", "/Fe:", bin_name), source_files),
-		};
+		job_start(cstr_array_concat(OPT_CMD("/Fe:", bin_name), object_files));
 #endif
-		INFO("CMD: %s", cmd_show(build_cmd));
-		cmd_run_sync(build_cmd);
 	}
 
 #if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+	// Both libraries carry their own copy of the stb libraries, which allocate through the tracking allocator
+	Cstr_Array lib_objects = cstr_array_concat(CSTR_ARRAY_MAKE(out_file), stb_files);
+
 	INFO("Building static library:");
-	Cstr out_file = PATH(BUILD_DIR, CONCAT(NOEXT(BASENAME(in_file)), ".o"));
-	if (IS_NEWER(in_file, out_file)) {
-		CMD(CC, CFLAGS, "-o", out_file, "-c", in_file);
+	Cstr lib_name = PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".a"));
+	int should_build_lib = 0;
+	FOREACH_ARRAY(Cstr , file, lib_objects, {
+		should_build_lib = should_build_lib || needs_rebuild(*file, lib_name);
+	});
+	if (should_build_lib) {
+		// 'r' only replaces members, so the archive is created from scratch to drop objects that are gone
+		if (PATH_EXISTS(lib_name)) {
+			RM(lib_name);
+		}
+		job_start(cstr_array_concat(CSTR_ARRAY_MAKE("ar", "rcs", lib_name), lib_objects));
 	}
 
-	Cstr lib_name = PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".a"));
-	if (IS_NEWER(out_file, lib_name)) {
-		CMD("ar", "rcs", lib_name, out_file);
+	INFO("Building shared library:");
+	Cstr shared_lib_name = PATH(BUILD_DIR, SHARED_LIB_NAME);
+	int should_build_shared = needs_rebuild(VERSION_SCRIPT, shared_lib_name);
+	FOREACH_ARRAY(Cstr , file, lib_objects, {
+		should_build_shared = should_build_shared || needs_rebuild(*file, shared_lib_name);
+	});
+	if (should_build_shared) {
+		job_start(cstr_array_concat(cstr_array_concat(OPT_CMD(SHARED_LDFLAGS, "-o", shared_lib_name), lib_objects),
+		                            CSTR_ARRAY_MAKE(LDFLAGS)));
 	}
 #elif defined(_MSC_VER)
 	INFO("Building static library:");
-	Cstr out_file = PATH(BUILD_DIR, CONCAT(NOEXT(BASENAME(in_file)), ".obj"));
-	if (IS_NEWER(in_file, out_file)) {
-		CMD(CC, CFLAGS, "/Fo:", out_file, "/c", in_file);
+	Cstr_Array lib_objects = cstr_array_concat(CSTR_ARRAY_MAKE(out_file), stb_files);
+	Cstr lib_name = PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".lib"));
+	int should_build_lib = 0;
+	FOREACH_ARRAY(Cstr , file, lib_objects, {
+		should_build_lib = should_build_lib || needs_rebuild(*file, lib_name);
+	});
+	if (should_build_lib) {
+		job_start(cstr_array_concat(CSTR_ARRAY_MAKE("lib", "/LTCG", CONCAT("/OUT:", lib_name)), lib_objects));
+	}
+#endif
+	jobs_wait();
+
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+	// Programs link against the unversioned name, which resolves to the soname at runtime
+	Cstr shared_lib_link = PATH(BUILD_DIR, SHARED_LIB_LINK);
+	if (!PATH_EXISTS(shared_lib_link)) {
+		CMD("ln", "-s", SHARED_LIB_NAME, shared_lib_link);
 	}
+#endif
 
-	Cstr lib_name = PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".lib"));
-	if (IS_NEWER(out_file, lib_name)) {
-		CMD("lib", out_file, CONCAT("/OUT:", lib_name));
+	// Without RECTILINEARIZE_IMPLEMENTATION it only declares the API, so it is the header of the libraries as well
+	build_single_header(PATH(BUILD_DIR, CONCAT(BINARY_NAME, ".h")));
+}
+
+// Build the benchmark against the static library
+static Cstr build_bench(void) {
+	Cstr bench_src = PATH(SRC_DIR, "bench.c");
+	Cstr bench_name = PATH(BUILD_DIR, "bench");
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+	Cstr_Array link_files = CSTR_ARRAY_MAKE(bench_src, PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".a")));
+#elif defined(_MSC_VER)
+	Cstr_Array link_files = CSTR_ARRAY_MAKE(bench_src, PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".lib")));
+#endif
+
+	int should_build_bench = 0;
+	FOREACH_ARRAY(Cstr , file, link_files, {
+		should_build_bench = should_build_bench || needs_rebuild(*file, bench_name);
+	});
+
+	if (should_build_bench) {
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+		run_cmd(cstr_array_concat(cstr_array_concat(OPT_CMD(CFLAGS, "-o", bench_name), link_files),
+		                          CSTR_ARRAY_MAKE(LDFLAGS)));
+#elif defined(_MSC_VER)
+		run_cmd(cstr_array_concat(OPT_CMD(CFLAGS, "/Fe:", bench_name), link_files));
+#endif
 	}
+
+	return bench_name;
+}
+
+static Cstr build_tests(void) {
+	Cstr test_src = PATH(SRC_DIR, "test.c");
+	Cstr test_name = PATH(BUILD_DIR, "test");
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+	Cstr_Array link_files = CSTR_ARRAY_MAKE(test_src, PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".a")));
+#elif defined(_MSC_VER)
+	Cstr_Array link_files = CSTR_ARRAY_MAKE(test_src, PATH(BUILD_DIR, CONCAT("lib", BINARY_NAME, ".lib")));
+#endif
+
+	int should_build_tests = 0;
+	FOREACH_ARRAY(Cstr , file, link_files, {
+		should_build_tests = should_build_tests || needs_rebuild(*file, test_name);
+	});
+
+	if (should_build_tests) {
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+		run_cmd(cstr_array_concat(cstr_array_concat(OPT_CMD(CFLAGS, "-o", test_name), link_files),
+		                          CSTR_ARRAY_MAKE(LDFLAGS)));
+#elif defined(_MSC_VER)
+		run_cmd(cstr_array_concat(OPT_CMD(CFLAGS, "/Fe:", test_name), link_files));
 #endif
+	}
+
+	return test_name;
+}
 
-	if (IS_NEWER(PATH(SRC_DIR, "main.h"), PATH(BUILD_DIR, CONCAT(BINARY_NAME, ".h")))) {
-		COPY(PATH(SRC_DIR, "main.h"), PATH(BUILD_DIR, CONCAT(BINARY_NAME, ".h")));
+// Run the benchmark with 'args'
+static void bench(Cstr_Array args) {
+	Cstr bench_name = build_bench();
+	if (!PATH_EXISTS(PATH(BUILD_DIR, "baselines"))) {
+		MKDIRS(PATH(BUILD_DIR, "baselines"));
 	}
+
+	run_cmd(cstr_array_concat(CSTR_ARRAY_MAKE(bench_name), args));
 }
 
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+// Builds instrumented binaries and trains them on the benchmark masks. The benchmark trains the library and writes its
+// masks to disk, so the binary can be trained on decoding and extracting the same images
+static void pgo_train(void) {
+	if (PATH_EXISTS(PGO_DIR)) {
+		RM(PGO_DIR);
+	}
+	Cstr corpus_dir = PATH(PGO_DIR, "corpus");
+	MKDIRS(PGO_DIR, "corpus");
+	MKDIRS(PATH(PGO_DIR, "out"));
+
+	use_flags(CSTR_ARRAY_MAKE(PGO_GENERATE_FLAGS));
+	build();
+	Cstr bench_name = build_bench();
+	run_cmd(CSTR_ARRAY_MAKE(bench_name, "--max-size", "1024", "--reps", "3", "--corpus", corpus_dir));
+
+	Cstr_Array corpus = {0};
+	FOREACH_FILE_IN_DIR(file, corpus_dir, {
+		if (ENDS_WITH(file, ".tga")) {
+			corpus = cstr_array_append(corpus, PATH(corpus_dir, file));
+		}
+	});
+	run_cmd(cstr_array_concat(CSTR_ARRAY_MAKE(PATH(BUILD_DIR, BINARY_NAME), "--force", "--output-dir", PATH(PGO_DIR, "out")), corpus));
+
+#ifdef __clang__
+	FOREACH_FILE_IN_DIR(file, PGO_DIR, {
+		if (ENDS_WITH(file, ".profraw")) {
+			CMD("llvm-profdata", "merge", "-output", PATH(PGO_DIR, "default.profdata"), PATH(PGO_DIR, file));
+		}
+	});
+#endif
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	GO_REBUILD_URSELF(argc, argv);
 
 	int clean_build_files = 0;
 	int dump_cflags = 0;
+	int run_bench = 0;
+	int run_tests = 0;
+	int pgo = 0;
+	Cstr profile = "default";
+	max_jobs = default_jobs() < MAX_JOBS ? default_jobs() : MAX_JOBS;
+	Cstr_Array bench_args = {0};
 	for (int i = 1; i < argc; ++i) {
 		if (STARTS_WITH(argv[i], "--clean")) {
 			clean_build_files = 1;
@@ -151,6 +510,45 @@ int main(int argc, char **argv)
 			dump_cflags = 1;
 			continue;
 		}
+
+		// Both '-jN' and '-j N' are accepted
+		if (STARTS_WITH(argv[i], "-j")) {
+			Cstr count = argv[i][2] != '\0' ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "0");
+			if (atoi(count) <= 0) {
+				PANIC("Expected a positive number of jobs after -j, got %s", count);
+			}
+			max_jobs = (size_t) atoi(count) < MAX_JOBS ? (size_t) atoi(count) : MAX_JOBS;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--test")) {
+			run_tests = 1;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--profile") && i + 1 < argc) {
+			profile = argv[++i];
+			continue;
+		}
+
+		// Baselines are kept by name in the build directory
+		if ((STARTS_WITH(argv[i], "--bench-save") || STARTS_WITH(argv[i], "--bench-compare")) && i + 1 < argc) {
+			run_bench = 1;
+			bench_args = cstr_array_append(bench_args, STARTS_WITH(argv[i], "--bench-save") ? "--save" : "--compare");
+			bench_args = cstr_array_append(bench_args, PATH(BUILD_DIR, "baselines", CONCAT(argv[i + 1], ".txt")));
+			i += 1;
+			continue;
+		}
+
+		// Everything after '--bench' is passed on to the benchmark
+		if (STARTS_WITH(argv[i], "--bench")) {
+			run_bench = 1;
+			bench_args = cstr_array_concat(bench_args, (Cstr_Array) {
+				.elems = (Cstr *) argv + i + 1,
+				.count = (size_t) (argc - i - 1),
+			});
+			break;
+		}
 	}
 
 	if (clean_build_files) {
@@ -162,7 +560,48 @@ int main(int argc, char **argv)
 		create_ccls_file(argv[0]);
 	}
 
+	if (!PATH_EXISTS(BUILD_DIR)) {
+		MKDIRS(BUILD_DIR);
+	}
+
+	// Every profile adds to the one before it
+	if (strcmp(profile, "default") == 0) {
+		use_flags(CSTR_ARRAY_MAKE(EXTRA_CFLAGS));
+	} else if (strcmp(profile, "release-native") == 0) {
+		use_flags(CSTR_ARRAY_MAKE(RELEASE_NATIVE_FLAGS));
+	} else if (strcmp(profile, "lto") == 0) {
+		use_flags(CSTR_ARRAY_MAKE(LTO_FLAGS));
+	} else if (strcmp(profile, "pgo") == 0) {
+#if defined(__GNUC__) || (defined(__clang__) && ! defined(_MSC_VER))
+		// Training only happens again after the sources changed
+		pgo = 1;
+		use_flags(CSTR_ARRAY_MAKE(PGO_USE_FLAGS));
+		if (rebuild_all || IS_NEWER(SRC_DIR, PATH(BUILD_DIR, BINARY_NAME)) || IS_NEWER(SRC_DIR, PATH(BUILD_DIR, "bench"))) {
+			pgo_train();
+			use_flags(CSTR_ARRAY_MAKE(PGO_USE_FLAGS));
+		}
+#else
+		PANIC("The pgo profile is only supported with GCC and Clang");
+#endif
+	} else {
+		PANIC("Unknown profile %s, expected default, release-native, lto or pgo", profile);
+	}
+
 	build();
 
+	// The benchmark was part of the training, so it is always built with its profile
+	if (pgo) {
+		build_bench();
+	}
+
+	// A failing test fails the command, so it stops the build before the benchmark runs
+	if (run_tests) {
+		run_cmd(CSTR_ARRAY_MAKE(build_tests()));
+	}
+
+	if (run_bench) {
+		bench(bench_args);
+	}
+
 	return 0;
 }
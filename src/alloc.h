@@ -0,0 +1,54 @@
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+
+// Routes every allocation of stb_ds and stb_image through the allocator set with `rectilinearize_set_allocator`, which
+// also keeps the counters of `rectilinearize_alloc_stats`. nobuild force includes this into the stb implementations.
+// Every other file has to include it before stb_ds.h, because the stb_ds macros free memory in the including file.
+void *rectilinearize_alloc_realloc(void *ptr, size_t size);
+void rectilinearize_alloc_free(void *ptr);
+
+// The stb_ds functions get names of their own, so a program that links another stb_ds next to the libraries never
+// mixes it with this one. Its arrays would be freed at the wrong address by the inline macros of the other.
+#define stbds_rand_seed     rectilinearize__stbds_rand_seed
+#define stbds_hash_bytes    rectilinearize__stbds_hash_bytes
+#define stbds_hash_string   rectilinearize__stbds_hash_string
+#define stbds_stralloc      rectilinearize__stbds_stralloc
+#define stbds_strreset      rectilinearize__stbds_strreset
+#define stbds_unit_tests    rectilinearize__stbds_unit_tests
+#define stbds_arrgrowf      rectilinearize__stbds_arrgrowf
+#define stbds_arrfreef      rectilinearize__stbds_arrfreef
+#define stbds_hmfree_func   rectilinearize__stbds_hmfree_func
+#define stbds_hmget_key     rectilinearize__stbds_hmget_key
+#define stbds_hmget_key_ts  rectilinearize__stbds_hmget_key_ts
+#define stbds_hmput_default rectilinearize__stbds_hmput_default
+#define stbds_hmput_key     rectilinearize__stbds_hmput_key
+#define stbds_hmdel_key     rectilinearize__stbds_hmdel_key
+#define stbds_shmode_func   rectilinearize__stbds_shmode_func
+
+#define STBDS_REALLOC(context, ptr, size) rectilinearize_alloc_realloc(ptr, size)
+#define STBDS_FREE(context, ptr)          rectilinearize_alloc_free(ptr)
+
+#define STBI_MALLOC(size)       rectilinearize_alloc_realloc(NULL, size)
+#define STBI_REALLOC(ptr, size) rectilinearize_alloc_realloc(ptr, size)
+#define STBI_FREE(ptr)          rectilinearize_alloc_free(ptr)
+
+// stb_ds seeds every new hash map from a single global seed, which it advances without any synchronization. A map is
+// created by its first insert, so maps that may be filled on several threads at once are filled with `hmput_locked`.
+// A lookup on an empty map already allocates the map, but its hash table is still only built by the first insert.
+void rectilinearize_hash_lock(void);
+void rectilinearize_hash_unlock(void);
+
+#define hmput_locked(map, key, value)                                 \
+	do {                                                              \
+		if ((map) == NULL || stbds_header(map)->hash_table == NULL) { \
+			rectilinearize_hash_lock();                               \
+			hmput(map, key, value);                                   \
+			rectilinearize_hash_unlock();                             \
+		} else {                                                      \
+			hmput(map, key, value);                                   \
+		}                                                             \
+	} while (0)
+
+#endif // ALLOC_H_
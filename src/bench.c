@@ -0,0 +1,716 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <nobuild/nobuild_log.h>
+#include <nobuild/nobuild_cstr.h>
+
+#include "main.h"
+
+// Benchmark of the extractor on synthetic masks generated in memory. Built and run by `./nobuild --bench`.
+//
+// Every feature of the masks is made of blocks of at least BENCH_BLOCK pixels, so none of them contain the single
+// pixel protrusions the extractor can not handle.
+//
+// The checker, blobs and islands masks are made of many separate shapes. Every corner of them is scanned, sorted and
+// put into the edge maps, but the walk only follows the ring of the first shape, so their walk time and vertices per
+// second cover that ring alone. The solid, stairs and comb masks are a single shape whose ring holds every corner.
+
+#define BENCH_BLOCK 4
+
+static const int bench_sizes[] = { 64, 256, 1024, 4096, 16384, 32768 };
+
+typedef bool (*Bench_Pattern)(int x, int y, int size);
+
+static bool pattern_solid(int x, int y, int size) {
+	int margin = size / 8;
+	return x >= margin && y >= margin && x < size - margin && y < size - margin;
+}
+
+static bool pattern_stairs(int x, int y, int size) {
+	(void) size;
+	return x / BENCH_BLOCK >= y / BENCH_BLOCK;
+}
+
+static bool pattern_checker(int x, int y, int size) {
+	(void) size;
+	return ((x / (BENCH_BLOCK * 2) + y / (BENCH_BLOCK * 2)) & 1) == 0;
+}
+
+// Cheap integer hash used to derive the noise of a block from its coordinates
+static uint32_t hash_block(uint32_t x, uint32_t y) {
+	uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	return h;
+}
+
+// Blocks of random noise smoothed over their 3x3 neighborhood, which gives irregular blobs with holes
+static bool pattern_blobs(int x, int y, int size) {
+	(void) size;
+	uint32_t bx = (uint32_t) (x / BENCH_BLOCK), by = (uint32_t) (y / BENCH_BLOCK);
+	int sum = 0;
+	for (uint32_t dy = 0; dy < 3; ++dy) {
+		for (uint32_t dx = 0; dx < 3; ++dx) {
+			sum += (int) (hash_block(bx + dx, by + dy) & 0xff);
+		}
+	}
+	return sum > 9 * 128;
+}
+
+static bool pattern_islands(int x, int y, int size) {
+	(void) size;
+	int period = BENCH_BLOCK * 16;
+	return x % period >= BENCH_BLOCK * 4 && x % period < BENCH_BLOCK * 8 && y % period >= BENCH_BLOCK * 4 && y % period < BENCH_BLOCK * 8;
+}
+
+// A single shape with a lot of corners: a spine along the left edge with a bar every 4 blocks, and teeth hanging off
+// every bar that stop a block short of the next one
+static bool pattern_comb(int x, int y, int size) {
+	(void) size;
+	int row = y % (BENCH_BLOCK * 4);
+	return x < BENCH_BLOCK || row < BENCH_BLOCK || (row < BENCH_BLOCK * 3 && x % (BENCH_BLOCK * 2) < BENCH_BLOCK);
+}
+
+static const struct {
+	const char *name;
+	Bench_Pattern fill;
+} bench_patterns[] = {
+	{ "solid", pattern_solid },
+	{ "stairs", pattern_stairs },
+	{ "checker", pattern_checker },
+	{ "blobs", pattern_blobs },
+	{ "islands", pattern_islands },
+	{ "comb", pattern_comb },
+};
+
+static void generate(unsigned char *data, int size, Bench_Pattern fill) {
+	for (int y = 0; y < size; ++y) {
+		unsigned char *row = data + (size_t) y * (size_t) size * 4;
+		for (int x = 0; x < size; ++x) {
+			unsigned char alpha = fill(x, y, size) ? 255 : 0;
+			row[x * 4 + 0] = alpha;
+			row[x * 4 + 1] = alpha;
+			row[x * 4 + 2] = alpha;
+			row[x * 4 + 3] = alpha;
+		}
+	}
+}
+
+enum { STAGE_SCAN, STAGE_SORT_Y, STAGE_SORT_X, STAGE_EDGES, STAGE_WALK, STAGE_TOTAL, STAGE_COUNT };
+
+static const char *stage_names[STAGE_COUNT] = { "scan", "sort_y", "sort_x", "edges", "walk", "total" };
+
+// Median and median absolute deviation of every stage of one case
+typedef struct {
+	char name[16];
+	int size;
+	uint64_t median[STAGE_COUNT];
+	uint64_t mad[STAGE_COUNT];
+} Bench_Result;
+
+#define BENCH_MAX_RESULTS (sizeof bench_sizes / sizeof *bench_sizes * sizeof bench_patterns / sizeof *bench_patterns)
+
+// Stages faster than this in the baseline are too close to the clock resolution to be compared
+#define BENCH_MIN_COMPARE_NS 10000
+
+// Cases faster than this are repeated more than '--reps' times, up to BENCH_MAX_REPS
+#define BENCH_MIN_CASE_NS 200000000ull
+#define BENCH_MAX_REPS 10000
+
+// A change is only significant when it is this many scaled MADs away from the baseline
+#define BENCH_MAD_FACTOR 3.0
+
+// Writes the mask as an uncompressed 32 bit TGA, which stb_image decodes with its alpha channel. Every channel of a
+// pixel holds the same value, so the BGRA order of TGA needs no swizzling
+static bool write_tga(const char *path, const unsigned char *data, int size) {
+	unsigned char header[18] = {0};
+	header[2] = 2;       // Uncompressed true color
+	header[12] = (unsigned char) size;
+	header[13] = (unsigned char) (size >> 8);
+	header[14] = (unsigned char) size;
+	header[15] = (unsigned char) (size >> 8);
+	header[16] = 32;
+	header[17] = 0x28;   // Top left origin with 8 bits of alpha
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		ERRO("Could not open %s: %s", path, strerror(errno));
+		return false;
+	}
+	fwrite(header, 1, sizeof header, f);
+	fwrite(data, 4, (size_t) size * (size_t) size, f);
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		ERRO("Could not write %s", path);
+	}
+	return ok;
+}
+
+static uint64_t stats_total(const RectilinearizeStats *stats) {
+	return stats->scan_ns + stats->sort_y_ns + stats->sort_x_ns + stats->edges_ns + stats->walk_ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+// Sorts 'values' in place
+static uint64_t median(uint64_t *values, size_t count) {
+	qsort(values, count, sizeof *values, compare_u64);
+	return (count & 1) ? values[count >> 1] : (values[(count >> 1) - 1] + values[count >> 1]) >> 1;
+}
+
+// Overwrites 'values' with their absolute deviations from 'center'
+static uint64_t median_abs_deviation(uint64_t *values, size_t count, uint64_t center) {
+	for (size_t i = 0; i < count; ++i) {
+		values[i] = values[i] > center ? values[i] - center : center - values[i];
+	}
+	return median(values, count);
+}
+
+static bool save_results(const char *path, const Bench_Result *results, size_t count) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		ERRO("Could not open %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	fprintf(f, "# case size stage median_ns mad_ns\n");
+	for (size_t i = 0; i < count; ++i) {
+		for (int s = 0; s < STAGE_COUNT; ++s) {
+			fprintf(f, "%s %d %s %" PRIu64 " %" PRIu64 "\n",
+				results[i].name, results[i].size, stage_names[s], results[i].median[s], results[i].mad[s]);
+		}
+	}
+
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		ERRO("Could not write %s", path);
+	}
+	return ok;
+}
+
+// Reads a file written by `save_results`. Returns the number of cases or -1 on failure
+static int load_results(const char *path, Bench_Result *results, size_t capacity) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		ERRO("Could not open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	size_t count = 0;
+	char line[256];
+	while (fgets(line, sizeof line, f) != NULL) {
+		char name[16], stage[16];
+		int size;
+		uint64_t med, mad;
+		if (line[0] == '#' || sscanf(line, "%15s %d %15s %" SCNu64 " %" SCNu64, name, &size, stage, &med, &mad) != 5) {
+			continue;
+		}
+
+		int s = 0;
+		while (s < STAGE_COUNT && strcmp(stage_names[s], stage) != 0) {
+			s += 1;
+		}
+		if (s == STAGE_COUNT) {
+			continue;
+		}
+
+		size_t i = 0;
+		while (i < count && (results[i].size != size || strcmp(results[i].name, name) != 0)) {
+			i += 1;
+		}
+		if (i == count) {
+			if (count == capacity) {
+				continue;
+			}
+			results[count] = (Bench_Result) { .size = size };
+			memcpy(results[count].name, name, sizeof name);
+			count += 1;
+		}
+		results[i].median[s] = med;
+		results[i].mad[s] = mad;
+	}
+
+	fclose(f);
+	return (int) count;
+}
+
+// A stage regressed when it got slower by more than 'threshold' and the difference is well outside the noise of both
+// runs. The MADs are scaled to estimate the standard deviation of normally distributed timings
+static bool is_regression(uint64_t base, uint64_t base_mad, uint64_t now, uint64_t now_mad, double threshold) {
+	if (base < BENCH_MIN_COMPARE_NS || now <= base) {
+		return false;
+	}
+
+	double diff = (double) (now - base);
+	double noise = 1.4826 * sqrt((double) base_mad * (double) base_mad + (double) now_mad * (double) now_mad);
+	return diff > threshold * (double) base && diff > BENCH_MAD_FACTOR * noise;
+}
+
+// Prints the change of every case against 'baseline'. Returns the number of regressed cases
+static size_t compare_results(const Bench_Result *baseline, size_t baseline_count, const Bench_Result *results,
+                              size_t count, double threshold) {
+	printf("\n%-8s %6s %12s %12s %8s\n", "case", "size", "base ms", "now ms", "change");
+
+	size_t regressions = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const Bench_Result *now = &results[i];
+		const Bench_Result *base = NULL;
+		for (size_t j = 0; j < baseline_count && base == NULL; ++j) {
+			if (baseline[j].size == now->size && strcmp(baseline[j].name, now->name) == 0) {
+				base = &baseline[j];
+			}
+		}
+		if (base == NULL) {
+			printf("%-8s %6d %12s %12.3f %8s\n", now->name, now->size, "-", (double) now->median[STAGE_TOTAL] / 1e6, "new");
+			continue;
+		}
+
+		double change = base->median[STAGE_TOTAL] > 0
+			? ((double) now->median[STAGE_TOTAL] / (double) base->median[STAGE_TOTAL] - 1.0) * 100.0
+			: 0.0;
+		printf("%-8s %6d %12.3f %12.3f %+7.1f%%", now->name, now->size, (double) base->median[STAGE_TOTAL] / 1e6,
+			(double) now->median[STAGE_TOTAL] / 1e6, change);
+
+		bool regressed = false;
+		for (int s = 0; s < STAGE_COUNT; ++s) {
+			if (is_regression(base->median[s], base->mad[s], now->median[s], now->mad[s], threshold)) {
+				printf("%s %s %+.1f%%", regressed ? "," : "  REGRESSION", stage_names[s],
+					((double) now->median[s] / (double) base->median[s] - 1.0) * 100.0);
+				regressed = true;
+			}
+		}
+		printf("\n");
+		regressions += regressed;
+	}
+
+	return regressions;
+}
+
+#define COUNTER_CACHE_MISS(cache) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} counter_events[] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "L1d-misses", PERF_TYPE_HW_CACHE, COUNTER_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+	{ "LLC-misses", PERF_TYPE_HW_CACHE, COUNTER_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+};
+
+#define COUNTER_COUNT (sizeof counter_events / sizeof *counter_events)
+
+// Hardware performance counters of this thread, read at every stage boundary through the stage hook of the library
+typedef struct {
+	int leader;                  // File descriptor of the group, -1 when no counter could be opened
+	int fds[COUNTER_COUNT];      // -1 for counters that are not supported or not permitted
+	size_t open_count;
+	bool failed;                 // The group could not be read, so the numbers are meaningless
+	RectilinearizeStage stage;   // Stage the counters are currently attributed to
+	uint64_t last[COUNTER_COUNT];
+	uint64_t totals[RECTILINEARIZE_STAGE_COUNT][COUNTER_COUNT];
+} Bench_Counters;
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+	return (int) syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+// Opens as many counters as the kernel allows and warns about the rest. Returns false when none of them could be opened
+static bool counters_open(Bench_Counters *c) {
+	*c = (Bench_Counters) { .leader = -1 };
+	int errors[COUNTER_COUNT] = {0};
+	for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+		// Only user space is counted, which is all an unprivileged process is allowed to see at the default paranoia.
+		// The leader is pinned, so a group that does not fit the PMU fails to read instead of being multiplexed
+		struct perf_event_attr attr = {
+			.size = sizeof attr,
+			.type = counter_events[i].type,
+			.config = counter_events[i].config,
+			.read_format = PERF_FORMAT_GROUP,
+			.disabled = c->leader < 0,
+			.pinned = c->leader < 0,
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+		};
+		c->fds[i] = perf_event_open(&attr, c->leader);
+		if (c->fds[i] < 0) {
+			errors[i] = errno;
+			continue;
+		}
+		if (c->leader < 0) {
+			c->leader = c->fds[i];
+		}
+		c->open_count += 1;
+	}
+
+	if (c->leader < 0) {
+		WARN("Hardware counters are not available: %s", strerror(errors[0]));
+		return false;
+	}
+	for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+		if (c->fds[i] < 0) {
+			WARN("Counter %s is not available: %s", counter_events[i].name, strerror(errors[i]));
+		}
+	}
+	return true;
+}
+
+static void counters_close(Bench_Counters *c) {
+	for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+		if (c->fds[i] >= 0) {
+			close(c->fds[i]);
+		}
+	}
+	c->leader = -1;
+}
+
+static void counters_hook(RectilinearizeStage stage, void *user) {
+	Bench_Counters *c = user;
+	uint64_t group[1 + COUNTER_COUNT];
+	ssize_t n = read(c->leader, group, sizeof group);
+	if (n < (ssize_t) (sizeof *group * (1 + c->open_count))) {
+		c->failed = true;
+		return;
+	}
+
+	// The values of the group come in the order the counters were opened in
+	for (size_t i = 0, v = 1; i < COUNTER_COUNT; ++i) {
+		if (c->fds[i] < 0) {
+			continue;
+		}
+		c->totals[c->stage][i] += group[v] - c->last[i];
+		c->last[i] = group[v++];
+	}
+	c->stage = stage;
+}
+
+// Adds the counters of 'reps' extractions of the image to the totals of every stage
+static void counters_measure(Bench_Counters *c, unsigned char *data, int size, int reps) {
+	memset(c->totals, 0, sizeof c->totals);
+	memset(c->last, 0, sizeof c->last);
+	c->stage = RECTILINEARIZE_STAGE_NONE;
+	c->failed = false;
+
+	ioctl(c->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(c->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	rectilinearize_set_stage_hook(counters_hook, c);
+	for (int i = 0; i < reps; ++i) {
+		int *points = NULL;
+		size_t point_count = 0;
+		RectilinearizeStats stats = {0};
+		rectilinearize_image_stats(data, size, size, &points, &point_count, &stats);
+		free(points);
+	}
+	rectilinearize_set_stage_hook(NULL, NULL);
+	ioctl(c->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void counters_print(const Bench_Counters *c, int reps) {
+	if (c->failed) {
+		WARN("The counters could not be read, they probably do not fit the PMU together");
+		return;
+	}
+
+	static const struct {
+		const char *name;
+		RectilinearizeStage stage;
+	} stages[] = {
+		{ "scan", RECTILINEARIZE_STAGE_SCAN },
+		{ "sort y", RECTILINEARIZE_STAGE_SORT_Y },
+		{ "sort x", RECTILINEARIZE_STAGE_SORT_X },
+		{ "edges", RECTILINEARIZE_STAGE_EDGES },
+		{ "walk", RECTILINEARIZE_STAGE_WALK },
+	};
+
+	printf("  %-8s", "per run");
+	for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+		printf(" %14s", counter_events[i].name);
+	}
+	printf(" %6s\n", "IPC");
+
+	for (size_t s = 0; s < sizeof stages / sizeof *stages; ++s) {
+		const uint64_t *totals = c->totals[stages[s].stage];
+		printf("  %-8s", stages[s].name);
+		for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+			if (c->fds[i] < 0) {
+				printf(" %14s", "-");
+			} else {
+				printf(" %14" PRIu64, totals[i] / (uint64_t) reps);
+			}
+		}
+		if (c->fds[0] >= 0 && c->fds[1] >= 0 && totals[0] > 0) {
+			printf(" %6.2f\n", (double) totals[1] / (double) totals[0]);
+		} else {
+			printf(" %6s\n", "-");
+		}
+	}
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Size of the image updated by `bench_update`
+#define UPDATE_WIDTH 7680
+#define UPDATE_HEIGHT 4320
+
+// Compares `rectilinearize_result_update` after a small stroke with a full extraction of an 8K comb. The update scans
+// only the stroke and pairs up the corners of its rows and columns again, but still walks every vertex of the polygon
+static int bench_update(int reps) {
+	unsigned char *data = malloc((size_t) UPDATE_WIDTH * UPDATE_HEIGHT * 4);
+	uint64_t *full = malloc(sizeof *full * (size_t) reps);
+	uint64_t *update = malloc(sizeof *update * (size_t) reps);
+	if (data == NULL || full == NULL || update == NULL) {
+		ERRO("Could not allocate a %dx%d image", UPDATE_WIDTH, UPDATE_HEIGHT);
+		free(data);
+		free(full);
+		free(update);
+		return 1;
+	}
+	for (int y = 0; y < UPDATE_HEIGHT; ++y) {
+		for (int x = 0; x < UPDATE_WIDTH; ++x) {
+			memset(data + ((size_t) y * UPDATE_WIDTH + (size_t) x) * 4, pattern_comb(x, y, 0) ? 255 : 0, 4);
+		}
+	}
+
+	RectilinearizeResult *result = rectilinearize_result_create(data, UPDATE_WIDTH, UPDATE_HEIGHT);
+	if (result == NULL) {
+		PANIC("Could not create the result");
+	}
+
+	size_t corners = 0;
+	for (int i = 0; i < reps; ++i) {
+		int *points = NULL;
+		size_t point_count = 0;
+		RectilinearizeStats stats = {0};
+		rectilinearize_image_stats(data, UPDATE_WIDTH, UPDATE_HEIGHT, &points, &point_count, &stats);
+		full[i] = stats_total(&stats);
+		corners = stats.corners;
+		free(points);
+
+		// Every stroke fills the gap between two teeth, which keeps the image a single shape without holes
+		int x = (int) (hash_block((uint32_t) i, 0) % (UPDATE_WIDTH / (BENCH_BLOCK * 2) - 1)) * BENCH_BLOCK * 2 + BENCH_BLOCK;
+		int y = (int) (hash_block((uint32_t) i, 1) % (UPDATE_HEIGHT / (BENCH_BLOCK * 4))) * BENCH_BLOCK * 4 + BENCH_BLOCK;
+		for (int dy = 0; dy < BENCH_BLOCK * 2; ++dy) {
+			memset(data + ((size_t) (y + dy) * UPDATE_WIDTH + (size_t) x) * 4, 255, BENCH_BLOCK * 4);
+		}
+		uint64_t start = now_ns();
+		rectilinearize_result_update(result, data, x, y, BENCH_BLOCK, BENCH_BLOCK * 2);
+		update[i] = now_ns() - start;
+	}
+
+	printf("%dx%d comb, %zu corners, %d reps\n", UPDATE_WIDTH, UPDATE_HEIGHT, corners, reps);
+	printf("  %-24s %10.3f ms\n", "full extraction", (double) median(full, (size_t) reps) / 1e6);
+	printf("  %-24s %10.3f ms\n", "update after a stroke", (double) median(update, (size_t) reps) / 1e6);
+
+	rectilinearize_result_free(result);
+	free(data);
+	free(full);
+	free(update);
+	return 0;
+}
+
+static void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [--max-size N] [--reps N] [--warmup N] [--filter PATTERN] [--save FILE] [--compare FILE] "
+		"[--threshold PERCENT] [--counters] [--corpus DIR] [--update]\n", program);
+}
+
+int main(int argc, char **argv) {
+	int max_size = 4096;
+	int reps = 5;
+	int warmup = 1;
+	const char *filter = NULL;
+	const char *save_path = NULL;
+	const char *compare_path = NULL;
+	double threshold = 0.05;
+	bool use_counters = false;
+	const char *corpus_dir = NULL;
+	bool update = false;
+	for (int i = 1; i < argc; ++i) {
+		if (STARTS_WITH(argv[i], "--max-size") && i + 1 < argc) {
+			max_size = atoi(argv[++i]);
+		} else if (STARTS_WITH(argv[i], "--reps") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			reps = atoi(argv[++i]);
+		} else if (STARTS_WITH(argv[i], "--warmup") && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+			warmup = atoi(argv[++i]);
+		} else if (STARTS_WITH(argv[i], "--filter") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (STARTS_WITH(argv[i], "--save") && i + 1 < argc) {
+			save_path = argv[++i];
+		} else if (STARTS_WITH(argv[i], "--compare") && i + 1 < argc) {
+			compare_path = argv[++i];
+		} else if (STARTS_WITH(argv[i], "--threshold") && i + 1 < argc) {
+			threshold = atof(argv[++i]) / 100.0;
+		} else if (STARTS_WITH(argv[i], "--counters")) {
+			use_counters = true;
+		} else if (STARTS_WITH(argv[i], "--corpus") && i + 1 < argc) {
+			corpus_dir = argv[++i];
+		} else if (STARTS_WITH(argv[i], "--update")) {
+			update = true;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (update) {
+		return bench_update(reps);
+	}
+
+	// Load the baseline first so a missing file does not waste a whole run
+	Bench_Result baseline[BENCH_MAX_RESULTS];
+	int baseline_count = 0;
+	if (compare_path != NULL && (baseline_count = load_results(compare_path, baseline, BENCH_MAX_RESULTS)) < 0) {
+		return 1;
+	}
+
+	Bench_Counters counters = { .leader = -1 };
+	if (use_counters) {
+		counters_open(&counters);
+	}
+
+	uint64_t *samples[STAGE_COUNT] = {0};
+	size_t sample_capacity = 0;
+
+	Bench_Result results[BENCH_MAX_RESULTS];
+	size_t result_count = 0;
+
+	printf("%-8s %6s %5s %10s %10s %10s %10s %10s %10s %9s %9s %9s\n",
+		"case", "size", "reps", "scan ms", "sort y ms", "sort x ms", "edges ms", "walk ms", "total ms", "MP/s", "Mcorner/s",
+		"Mvert/s");
+
+	for (size_t z = 0; z < sizeof bench_sizes / sizeof *bench_sizes && bench_sizes[z] <= max_size; ++z) {
+		int size = bench_sizes[z];
+		unsigned char *data = malloc((size_t) size * (size_t) size * 4);
+		if (data == NULL) {
+			ERRO("Could not allocate a %dx%d image, skipping the remaining sizes", size, size);
+			break;
+		}
+
+		for (size_t p = 0; p < sizeof bench_patterns / sizeof *bench_patterns; ++p) {
+			if (filter != NULL && strstr(bench_patterns[p].name, filter) == NULL) {
+				continue;
+			}
+			generate(data, size, bench_patterns[p].fill);
+			if (corpus_dir != NULL) {
+				char path[4096];
+				snprintf(path, sizeof path, "%s/%s-%d.tga", corpus_dir, bench_patterns[p].name, size);
+				write_tga(path, data, size);
+			}
+
+			RectilinearizeStats stats = {0};
+			size_t vertices = 0;
+			int case_reps = reps;
+			for (int i = 0; i < warmup + case_reps; ++i) {
+				int *points = NULL;
+				size_t point_count = 0;
+				stats = (RectilinearizeStats) {0};
+				rectilinearize_image_stats(data, size, size, &points, &point_count, &stats);
+				vertices = point_count;
+				free(points);
+
+				// Small cases are repeated until they fill BENCH_MIN_CASE_NS, so their medians are as stable as the rest
+				if (i == (warmup > 0 ? warmup - 1 : 0)) {
+					uint64_t total = stats_total(&stats) > 0 ? stats_total(&stats) : 1;
+					if ((uint64_t) case_reps * total < BENCH_MIN_CASE_NS) {
+						case_reps = (int) (BENCH_MIN_CASE_NS / total < BENCH_MAX_REPS ? BENCH_MIN_CASE_NS / total : BENCH_MAX_REPS);
+					}
+					if ((size_t) case_reps > sample_capacity) {
+						sample_capacity = (size_t) case_reps;
+						for (int s = 0; s < STAGE_COUNT; ++s) {
+							samples[s] = realloc(samples[s], sizeof *samples[s] * sample_capacity);
+							if (samples[s] == NULL) {
+								PANIC("Could not allocate %d samples", case_reps);
+							}
+						}
+					}
+				}
+
+				if (i >= warmup) {
+					size_t r = (size_t) (i - warmup);
+					samples[STAGE_SCAN][r] = stats.scan_ns;
+					samples[STAGE_SORT_Y][r] = stats.sort_y_ns;
+					samples[STAGE_SORT_X][r] = stats.sort_x_ns;
+					samples[STAGE_EDGES][r] = stats.edges_ns;
+					samples[STAGE_WALK][r] = stats.walk_ns;
+					samples[STAGE_TOTAL][r] = stats_total(&stats);
+				}
+			}
+
+			Bench_Result *result = &results[result_count++];
+			*result = (Bench_Result) { .size = size };
+			snprintf(result->name, sizeof result->name, "%s", bench_patterns[p].name);
+
+			double ms[STAGE_COUNT];
+			for (int s = 0; s < STAGE_COUNT; ++s) {
+				result->median[s] = median(samples[s], (size_t) case_reps);
+				result->mad[s] = median_abs_deviation(samples[s], (size_t) case_reps, result->median[s]);
+				ms[s] = (double) result->median[s] / 1e6;
+			}
+
+			double seconds = ms[STAGE_TOTAL] / 1e3;
+			double mpixels = (double) size * (double) size / 1e6;
+			printf("%-8s %6d %5d %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %9.1f %9.2f %9.2f\n",
+				bench_patterns[p].name, size, case_reps, ms[STAGE_SCAN], ms[STAGE_SORT_Y], ms[STAGE_SORT_X], ms[STAGE_EDGES],
+				ms[STAGE_WALK], ms[STAGE_TOTAL], seconds > 0 ? mpixels / seconds : 0.0,
+				seconds > 0 ? (double) stats.corners / 1e6 / seconds : 0.0, seconds > 0 ? (double) vertices / 1e6 / seconds : 0.0);
+
+			// Counted in separate runs, so reading the counters does not show up in the timings
+			if (counters.leader >= 0) {
+				counters_measure(&counters, data, size, reps);
+				counters_print(&counters, reps);
+			}
+			fflush(stdout);
+		}
+
+		free(data);
+	}
+
+	for (int s = 0; s < STAGE_COUNT; ++s) {
+		free(samples[s]);
+	}
+	if (counters.leader >= 0) {
+		counters_close(&counters);
+	}
+
+	int status = 0;
+	if (save_path != NULL) {
+		if (save_results(save_path, results, result_count)) {
+			INFO("Saved baseline to %s", save_path);
+		} else {
+			status = 1;
+		}
+	}
+
+	if (compare_path != NULL) {
+		size_t regressions = compare_results(baseline, (size_t) baseline_count, results, result_count, threshold);
+		if (regressions > 0) {
+			ERRO("%zu of %zu cases regressed by more than %.1f%% compared to %s", regressions, result_count,
+				threshold * 100.0, compare_path);
+			status = 1;
+		}
+	}
+
+	return status;
+}
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+// Has to come before the stb headers so their allocations are tracked
+#include "alloc.h"
+
+#include <stb_ds.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "dedup.h"
+#include "output.h"
+
+static bool same_shape(const Dedup_Shape *shape, const int *points, size_t point_count) {
+	return shape->point_count == point_count && memcmp(shape->points, points, sizeof *points * (point_count << 1)) == 0;
+}
+
+void dedup_add(Dedup *d, Cstr path, const int *points, size_t point_count) {
+	int min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+	if (point_count > 0) {
+		min_x = max_x = points[0];
+		min_y = max_y = points[1];
+	}
+	for (size_t i = 1; i < point_count; ++i) {
+		int x = points[(i << 1)], y = points[(i << 1) + 1];
+		min_x = x < min_x ? x : min_x;
+		max_x = x > max_x ? x : max_x;
+		min_y = y < min_y ? y : min_y;
+		max_y = y > max_y ? y : max_y;
+	}
+
+	// The walk always starts at the first corner in scan order, which does not change under translation, so two
+	// copies of a polygon are identical once moved to the origin
+	int *normalized = malloc(sizeof *normalized * ((point_count << 1) > 0 ? (point_count << 1) : 1));
+	if (normalized == NULL) {
+		PANIC("Could not allocate %zu vertices", point_count);
+	}
+	for (size_t i = 0; i < point_count; ++i) {
+		normalized[(i << 1)]     = points[(i << 1)] - min_x;
+		normalized[(i << 1) + 1] = points[(i << 1) + 1] - min_y;
+	}
+
+	// Colliding hashes of different shapes move on to the next key until a free or matching one is found
+	uint64_t key = stbds_hash_bytes(normalized, sizeof *normalized * (point_count << 1), 0);
+	ptrdiff_t bucket;
+	while ((bucket = hmgeti(d->index, key)) >= 0 && !same_shape(&d->shapes[d->index[bucket].value], normalized, point_count)) {
+		key += 1;
+	}
+
+	size_t shape;
+	if (bucket >= 0) {
+		shape = d->index[bucket].value;
+		free(normalized);
+	} else {
+		shape = arrlenu(d->shapes);
+		Dedup_Shape s = {
+			.points = normalized, .point_count = point_count, .width = max_x - min_x, .height = max_y - min_y,
+		};
+		arrput(d->shapes, s);
+		hmput_locked(d->index, key, shape);
+	}
+
+	Dedup_Instance instance = { .path = path, .shape = shape, .x = min_x, .y = min_y };
+	arrput(d->instances, instance);
+}
+
+void dedup_write(const Dedup *d, Writer *out) {
+	writer_put_str(out, "{\"shapes\":[");
+	for (size_t i = 0; i < arrlenu(d->shapes); ++i) {
+		const Dedup_Shape *s = &d->shapes[i];
+		writer_put_str(out, i > 0 ? ",{\"size\":[" : "{\"size\":[");
+		writer_put_int(out, s->width);
+		writer_put_char(out, ',');
+		writer_put_int(out, s->height);
+		writer_put_str(out, s->point_count > 0 ? "],\"rings\":[[" : "],\"rings\":[");
+		for (size_t j = 0; j < (s->point_count << 1); ++j) {
+			if (j > 0) {
+				writer_put_char(out, ',');
+			}
+			writer_put_int(out, s->points[j]);
+		}
+		writer_put_str(out, s->point_count > 0 ? "]]}" : "]}");
+	}
+
+	writer_put_str(out, "],\"instances\":[");
+	for (size_t i = 0; i < arrlenu(d->instances); ++i) {
+		const Dedup_Instance *instance = &d->instances[i];
+		writer_put_str(out, i > 0 ? ",{\"file\":" : "{\"file\":");
+		write_json_string(out, instance->path);
+		writer_put_str(out, ",\"shape\":");
+		writer_put_int(out, (long long) instance->shape);
+		writer_put_str(out, ",\"offset\":[");
+		writer_put_int(out, instance->x);
+		writer_put_char(out, ',');
+		writer_put_int(out, instance->y);
+		writer_put_str(out, "]}");
+	}
+	writer_put_str(out, "]}\n");
+}
+
+void dedup_free(Dedup *d) {
+	for (size_t i = 0; i < arrlenu(d->shapes); ++i) {
+		free(d->shapes[i].points);
+	}
+	arrfree(d->shapes);
+	arrfree(d->instances);
+	hmfree(d->index);
+}
@@ -0,0 +1,49 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nobuild/nobuild_cstr.h>
+
+#include "writer.h"
+
+// A unique polygon, translated so its bounding box starts at the origin
+typedef struct {
+	int *points;        // XY pairs of the normalized polygon
+	size_t point_count; // Number of vertices in 'points'
+	int width;          // Width of the bounding box
+	int height;         // Height of the bounding box
+} Dedup_Shape;
+
+// An occurrence of a shape: the polygon extracted from 'path' is `shapes[shape]` moved by ('x', 'y')
+typedef struct {
+	Cstr path;
+	size_t shape;
+	int x;
+	int y;
+} Dedup_Instance;
+
+typedef struct {
+	uint64_t key;  // Hash of the normalized polygon
+	size_t value;  // Index into `shapes`
+} Dedup_Bucket;
+
+// Collects the polygons of a batch and keeps every translated copy of the same polygon only once. All arrays are
+// stb_ds arrays.
+typedef struct {
+	Dedup_Shape *shapes;
+	Dedup_Instance *instances;
+	Dedup_Bucket *index; // stb_ds hash map from the hash of a normalized polygon to its shape
+} Dedup;
+
+// Adds the polygon extracted from 'path', reusing an existing shape when an identical one was added before
+void dedup_add(Dedup *d, Cstr path, const int *points, size_t point_count);
+
+// Writes every shape followed by every instance as a single JSON document:
+// `{"shapes":[{"size":[W,H],"rings":[[X,Y,...]]},...],"instances":[{"file":PATH,"shape":ID,"offset":[X,Y]},...]}`
+void dedup_write(const Dedup *d, Writer *out);
+
+void dedup_free(Dedup *d);
+
+#endif // DEDUP_H_
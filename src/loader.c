@@ -0,0 +1,504 @@
+// Needed for `struct statx`
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "loader.h"
+#include "trace.h"
+
+#define LOADER_THREADS 4
+
+typedef enum {
+	OP_OPEN = 0,
+	OP_STATX,
+	OP_READ,
+	OP_CLOSE,
+} Uring_Op;
+
+typedef struct {
+	Loader_File file;
+	bool done;          // 'file' is ready to be handed out
+	int fd;
+	unsigned pending;   // In-flight io_uring operations
+	size_t read;        // Bytes read so far
+	struct statx stx;
+} Loader_Slot;
+
+typedef struct {
+	int fd;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned to_submit;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+} Uring;
+
+struct Loader {
+	Cstr_Array paths;
+	size_t prefetch;
+	Loader_Slot *slots; // Ring of 'prefetch' slots, file `i` lives in slot `i % prefetch`
+	size_t next;        // Index of the next file to hand out
+	size_t started;     // Number of files whose read has been started
+
+	bool use_uring;
+	Uring ring;
+
+	pthread_t workers[LOADER_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Thin wrappers around the raw syscalls so we do not depend on liburing being installed
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(Uring *ring) {
+	munmap(ring->sqes, ring->sq_entries * sizeof *ring->sqes);
+	if (ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+// Checks that the kernel knows about every opcode the loader needs. OPENAT, STATX and READ all appeared in 5.6.
+static bool uring_supports_ops(int fd) {
+	size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probe_size);
+	if (probe == NULL) {
+		return false;
+	}
+
+	bool supported = uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) >= 0;
+	const int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+	for (size_t i = 0; supported && i < sizeof ops / sizeof *ops; ++i) {
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return supported;
+}
+
+static bool uring_init(Uring *ring, unsigned entries) {
+	struct io_uring_params params = {0};
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0) {
+		return false;
+	}
+
+	if (!uring_supports_ops(ring->fd)) {
+		close(ring->fd);
+		return false;
+	}
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		close(ring->fd);
+		return false;
+	}
+
+	ring->cq_ptr = ring->sq_ptr;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(ring->fd);
+			return false;
+		}
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof *ring->sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ptr != ring->sq_ptr) {
+			munmap(ring->cq_ptr, ring->cq_size);
+		}
+		munmap(ring->sq_ptr, ring->sq_size);
+		close(ring->fd);
+		return false;
+	}
+
+	unsigned char *sq = ring->sq_ptr;
+	ring->sq_head  = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask  = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+	unsigned char *cq = ring->cq_ptr;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	ring->to_submit = 0;
+	return true;
+}
+
+static void uring_submit(Uring *ring, unsigned min_complete) {
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while (ring->to_submit > 0 || min_complete > 0) {
+		int submitted = uring_enter(ring->fd, ring->to_submit, min_complete, flags);
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PANIC("io_uring_enter failed: %s", strerror(errno));
+		}
+
+		ring->to_submit -= (unsigned) submitted;
+		min_complete = 0;
+		flags = 0;
+	}
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *ring, Uring_Op op, size_t index) {
+	unsigned tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		uring_submit(ring, 0);
+	}
+
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->user_data = ((unsigned long long) index << 2) | op;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit += 1;
+	return sqe;
+}
+
+static void uring_start_file(Loader *loader, size_t index) {
+	Loader_Slot *slot = &loader->slots[index % loader->prefetch];
+	memset(slot, 0, sizeof *slot);
+	slot->file.path = loader->paths.elems[index];
+	slot->fd = -1;
+	slot->pending = 2;
+
+	// Both only need the path, so the open and the size lookup can run concurrently
+	struct io_uring_sqe *sqe = uring_get_sqe(&loader->ring, OP_OPEN, index);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long long) (uintptr_t) slot->file.path;
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+	sqe = uring_get_sqe(&loader->ring, OP_STATX, index);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long long) (uintptr_t) slot->file.path;
+	sqe->len = STATX_SIZE;
+	sqe->off = (unsigned long long) (uintptr_t) &slot->stx;
+}
+
+static void uring_read(Loader *loader, size_t index, Loader_Slot *slot) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&loader->ring, OP_READ, index);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (unsigned long long) (uintptr_t) (slot->file.data + slot->read);
+	sqe->len = (unsigned) (slot->file.size - slot->read);
+	sqe->off = slot->read;
+	slot->pending = 1;
+}
+
+static void uring_finish(Loader *loader, size_t index, Loader_Slot *slot) {
+	if (slot->fd >= 0) {
+		struct io_uring_sqe *sqe = uring_get_sqe(&loader->ring, OP_CLOSE, index);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = slot->fd;
+		slot->fd = -1;
+	}
+
+	if (slot->file.failed) {
+		free(slot->file.data);
+		slot->file.data = NULL;
+		slot->file.size = 0;
+	}
+	slot->done = true;
+}
+
+static void uring_complete(Loader *loader, struct io_uring_cqe *cqe) {
+	Uring_Op op = (Uring_Op) (cqe->user_data & 3);
+	size_t index = (size_t) (cqe->user_data >> 2);
+	Loader_Slot *slot = &loader->slots[index % loader->prefetch];
+	switch (op) {
+		case OP_OPEN:
+			if (cqe->res < 0) {
+				slot->file.failed = true;
+			} else {
+				slot->fd = cqe->res;
+			}
+			break;
+		case OP_STATX:
+			if (cqe->res < 0) {
+				slot->file.failed = true;
+			}
+			break;
+		case OP_READ:
+			if (cqe->res < 0) {
+				slot->file.failed = true;
+			} else {
+				slot->read += (size_t) cqe->res;
+				if (cqe->res > 0 && slot->read < slot->file.size) {
+					uring_read(loader, index, slot);
+					return;
+				}
+				slot->file.size = slot->read;
+			}
+			break;
+		case OP_CLOSE:
+			// The slot may already hold another file by the time the close completes
+			return;
+	}
+
+	slot->pending -= 1;
+	if (slot->pending > 0) {
+		return;
+	}
+
+	if (op == OP_READ || slot->file.failed) {
+		uring_finish(loader, index, slot);
+		return;
+	}
+
+	// Open and statx are both done, the size of the file is known
+	slot->file.size = (size_t) slot->stx.stx_size;
+	slot->file.data = malloc(slot->file.size > 0 ? slot->file.size : 1);
+	if (slot->file.data == NULL) {
+		slot->file.failed = true;
+		uring_finish(loader, index, slot);
+	} else if (slot->file.size == 0) {
+		uring_finish(loader, index, slot);
+	} else {
+		uring_read(loader, index, slot);
+	}
+}
+
+static void uring_reap(Loader *loader) {
+	Uring *ring = &loader->ring;
+	unsigned head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		uring_complete(loader, &ring->cqes[head & *ring->cq_mask]);
+		head += 1;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static bool uring_next(Loader *loader, Loader_File *file) {
+	while (loader->started < loader->paths.count && loader->started < loader->next + loader->prefetch) {
+		uring_start_file(loader, loader->started++);
+	}
+
+	Loader_Slot *slot = &loader->slots[loader->next % loader->prefetch];
+	uring_reap(loader);
+	while (!slot->done) {
+		uring_submit(&loader->ring, 1);
+		uring_reap(loader);
+	}
+
+	// Flush the closes queued by the last completions
+	uring_submit(&loader->ring, 0);
+
+	*file = slot->file;
+	slot->done = false;
+	loader->next += 1;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void pread_file(Loader_File *file) {
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		file->failed = true;
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		file->failed = true;
+		close(fd);
+		return;
+	}
+
+	file->size = (size_t) st.st_size;
+	file->data = malloc(file->size > 0 ? file->size : 1);
+	if (file->data == NULL) {
+		file->failed = true;
+		close(fd);
+		return;
+	}
+
+	size_t read = 0;
+	while (read < file->size) {
+		ssize_t n = pread(fd, file->data + read, file->size - read, (off_t) read);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		read += (size_t) n;
+	}
+	file->size = read;
+	close(fd);
+}
+
+static void *pread_worker(void *arg) {
+	Loader *loader = arg;
+	trace_thread_name("loader");
+
+	pthread_mutex_lock(&loader->lock);
+	while (true) {
+		while (loader->started < loader->paths.count && loader->started >= loader->next + loader->prefetch) {
+			pthread_cond_wait(&loader->cond, &loader->lock);
+		}
+
+		if (loader->started >= loader->paths.count) {
+			break;
+		}
+
+		size_t index = loader->started++;
+		Loader_Slot *slot = &loader->slots[index % loader->prefetch];
+		pthread_mutex_unlock(&loader->lock);
+
+		Loader_File file = { .path = loader->paths.elems[index] };
+		trace_begin("pread", file.path);
+		pread_file(&file);
+		trace_end();
+
+		pthread_mutex_lock(&loader->lock);
+		slot->file = file;
+		slot->done = true;
+		pthread_cond_broadcast(&loader->cond);
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+static bool pread_next(Loader *loader, Loader_File *file) {
+	pthread_mutex_lock(&loader->lock);
+	Loader_Slot *slot = &loader->slots[loader->next % loader->prefetch];
+	while (!slot->done) {
+		pthread_cond_wait(&loader->cond, &loader->lock);
+	}
+
+	*file = slot->file;
+	slot->done = false;
+	loader->next += 1;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Loader *loader_open(Cstr_Array paths, size_t prefetch) {
+	Loader *loader = calloc(1, sizeof *loader);
+	if (loader == NULL) {
+		PANIC("Could not allocate loader");
+	}
+
+	loader->paths = paths;
+	loader->prefetch = prefetch > 0 ? prefetch : 1;
+	loader->slots = calloc(loader->prefetch, sizeof *loader->slots);
+	if (loader->slots == NULL) {
+		PANIC("Could not allocate %zu loader slots", loader->prefetch);
+	}
+
+	// Every slot can have an open and a statx in flight, plus the close of the file it held before
+	unsigned entries = 1;
+	while (entries < 3 * loader->prefetch) {
+		entries <<= 1;
+	}
+
+	loader->use_uring = uring_init(&loader->ring, entries);
+	if (!loader->use_uring) {
+		pthread_mutex_init(&loader->lock, NULL);
+		pthread_cond_init(&loader->cond, NULL);
+		for (size_t i = 0; i < LOADER_THREADS; ++i) {
+			if (pthread_create(&loader->workers[i], NULL, pread_worker, loader) != 0) {
+				PANIC("Could not start loader thread");
+			}
+		}
+	}
+
+	return loader;
+}
+
+bool loader_next(Loader *loader, Loader_File *file) {
+	if (loader->next >= loader->paths.count) {
+		return false;
+	}
+
+	return loader->use_uring ? uring_next(loader, file) : pread_next(loader, file);
+}
+
+void loader_close(Loader *loader) {
+	if (loader->use_uring) {
+		// Drain whatever is still in flight so the kernel never writes into freed slots
+		for (size_t i = loader->next; i < loader->started; ++i) {
+			Loader_Slot *slot = &loader->slots[i % loader->prefetch];
+			while (!slot->done) {
+				uring_submit(&loader->ring, 1);
+				uring_reap(loader);
+			}
+			free(slot->file.data);
+		}
+		uring_submit(&loader->ring, 0);
+		uring_close(&loader->ring);
+	} else {
+		pthread_mutex_lock(&loader->lock);
+		loader->paths.count = loader->started;
+		pthread_cond_broadcast(&loader->cond);
+		pthread_mutex_unlock(&loader->lock);
+
+		for (size_t i = 0; i < LOADER_THREADS; ++i) {
+			pthread_join(loader->workers[i], NULL);
+		}
+		for (size_t i = loader->next; i < loader->started; ++i) {
+			free(loader->slots[i % loader->prefetch].file.data);
+		}
+		pthread_mutex_destroy(&loader->lock);
+		pthread_cond_destroy(&loader->cond);
+	}
+
+	free(loader->slots);
+	free(loader);
+}
@@ -0,0 +1,35 @@
+#ifndef LOADER_H_
+#define LOADER_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <nobuild/nobuild_cstr.h>
+
+typedef struct {
+	Cstr path;           // Path of the file
+	unsigned char *data; // Raw contents of the file. Owned by the caller once returned by `loader_next`
+	size_t size;         // Number of bytes in 'data'
+	bool failed;         // The file could not be opened or read
+} Loader_File;
+
+typedef struct Loader Loader;
+
+/**
+ * @brief Starts reading 'paths' in the background, keeping up to 'prefetch' files in flight.
+ *
+ * Reads are submitted through io_uring. When io_uring is unavailable, either because the kernel is too old or because
+ * it has been disabled, the files are read with `pread` on a small pool of threads instead.
+ */
+Loader *loader_open(Cstr_Array paths, size_t prefetch);
+
+/**
+ * @brief Blocks until the next file, in the order of 'paths', has been read.
+ *
+ * @return false once every file has been handed out.
+ */
+bool loader_next(Loader *loader, Loader_File *file);
+
+void loader_close(Loader *loader);
+
+#endif // LOADER_H_
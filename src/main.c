@@ -1,5 +1,22 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// Only the result cache needs these, it is compiled out on Windows
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Has to come before the stb headers so their allocations are tracked
+#include "alloc.h"
 
 #include <stb_image.h>
 #include <stb_ds.h>
@@ -15,10 +32,170 @@ typedef struct {
 	int width;           // Width of the image
 	int height;          // Height of the image
 	int channels;        // Number of channels in the image
+	int stride;          // Number of pixels from the start of one row to the next, equal to 'width' unless the image is a view
 } Image;
 
-#define INDEX_IMG(i, x, y) (i.width * y + x) * i.channels
-#define INDEX_IMGP(i, x, y) (i->width * y + x) * i->channels
+#define INDEX_IMG(i, x, y) (i.stride * y + x) * i.channels
+#define INDEX_IMGP(i, x, y) (i->stride * y + x) * i->channels
+
+// Building with RECTILINEARIZE_NO_STATS turns every `STATS_ON` check into a constant, so the instrumentation is
+// removed entirely by the compiler
+#ifndef RECTILINEARIZE_NO_STATS
+#define STATS_ON(stats) ((stats) != NULL)
+#else
+#define STATS_ON(stats) false
+#endif
+
+static uint64_t stats_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Every block handed out to stb_ds and stb_image starts with its size, so a free knows how many bytes it releases.
+// The header is as large as the strictest alignment to keep the block behind it aligned
+#define ALLOC_HEADER_SIZE _Alignof(max_align_t)
+
+static RectilinearizeAllocator allocator;
+
+static atomic_uint_fast64_t alloc_count;
+static atomic_uint_fast64_t realloc_count;
+static atomic_uint_fast64_t free_count;
+static atomic_uint_fast64_t alloc_bytes;
+static atomic_uint_fast64_t alloc_in_use;
+static atomic_uint_fast64_t alloc_peak;
+
+// The same counters for the current thread only, so the stats entry points can tell what a single extraction used
+static _Thread_local struct {
+	uint64_t calls;
+	int64_t in_use;   // Goes negative when this thread frees memory allocated by another one
+	int64_t peak;
+} thread_alloc;
+
+void rectilinearize_set_allocator(const RectilinearizeAllocator *a) {
+	allocator = a != NULL ? *a : (RectilinearizeAllocator) {0};
+}
+
+static void alloc_account(atomic_uint_fast64_t *counter, size_t old_size, size_t new_size) {
+	atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+	if (new_size >= old_size) {
+		uint64_t grown = new_size - old_size;
+		atomic_fetch_add_explicit(&alloc_bytes, grown, memory_order_relaxed);
+		uint64_t in_use = atomic_fetch_add_explicit(&alloc_in_use, grown, memory_order_relaxed) + grown;
+		uint64_t peak = atomic_load_explicit(&alloc_peak, memory_order_relaxed);
+		while (in_use > peak && !atomic_compare_exchange_weak_explicit(&alloc_peak, &peak, in_use, memory_order_relaxed, memory_order_relaxed)) {
+		}
+	} else {
+		atomic_fetch_sub_explicit(&alloc_in_use, old_size - new_size, memory_order_relaxed);
+	}
+
+	thread_alloc.calls += 1;
+	thread_alloc.in_use += (int64_t) new_size - (int64_t) old_size;
+	if (thread_alloc.in_use > thread_alloc.peak) {
+		thread_alloc.peak = thread_alloc.in_use;
+	}
+}
+
+void *rectilinearize_alloc_realloc(void *ptr, size_t size) {
+	unsigned char *block = NULL;
+	size_t old_size = 0;
+	if (ptr != NULL) {
+		block = (unsigned char *) ptr - ALLOC_HEADER_SIZE;
+		memcpy(&old_size, block, sizeof old_size);
+	}
+	if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+		return NULL;
+	}
+
+	unsigned char *fresh = allocator.realloc != NULL
+		? allocator.realloc(allocator.user, block, size + ALLOC_HEADER_SIZE)
+		: realloc(block, size + ALLOC_HEADER_SIZE);
+	if (fresh == NULL) {
+		return NULL;
+	}
+
+	memcpy(fresh, &size, sizeof size);
+	alloc_account(ptr != NULL ? &realloc_count : &alloc_count, old_size, size);
+	return fresh + ALLOC_HEADER_SIZE;
+}
+
+void rectilinearize_alloc_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	unsigned char *block = (unsigned char *) ptr - ALLOC_HEADER_SIZE;
+	size_t size;
+	memcpy(&size, block, sizeof size);
+	alloc_account(&free_count, size, 0);
+	if (allocator.free != NULL) {
+		allocator.free(allocator.user, block);
+	} else {
+		free(block);
+	}
+}
+
+void rectilinearize_alloc_stats(RectilinearizeAllocStats *stats) {
+	*stats = (RectilinearizeAllocStats) {
+		.allocations = atomic_load_explicit(&alloc_count, memory_order_relaxed),
+		.reallocations = atomic_load_explicit(&realloc_count, memory_order_relaxed),
+		.frees = atomic_load_explicit(&free_count, memory_order_relaxed),
+		.bytes_allocated = atomic_load_explicit(&alloc_bytes, memory_order_relaxed),
+		.bytes_in_use = atomic_load_explicit(&alloc_in_use, memory_order_relaxed),
+		.peak_bytes_in_use = atomic_load_explicit(&alloc_peak, memory_order_relaxed),
+	};
+}
+
+void rectilinearize_alloc_stats_reset(void) {
+	atomic_store_explicit(&alloc_count, 0, memory_order_relaxed);
+	atomic_store_explicit(&realloc_count, 0, memory_order_relaxed);
+	atomic_store_explicit(&free_count, 0, memory_order_relaxed);
+	atomic_store_explicit(&alloc_bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&alloc_peak, atomic_load_explicit(&alloc_in_use, memory_order_relaxed), memory_order_relaxed);
+}
+
+// Creating a hash map is rare and short, so a spin lock is enough
+static atomic_flag hash_lock = ATOMIC_FLAG_INIT;
+
+void rectilinearize_hash_lock(void) {
+	while (atomic_flag_test_and_set_explicit(&hash_lock, memory_order_acquire)) {
+	}
+}
+
+void rectilinearize_hash_unlock(void) {
+	atomic_flag_clear_explicit(&hash_lock, memory_order_release);
+}
+
+// Marks the start of an extraction on this thread, see `thread_alloc_end`
+static int64_t thread_alloc_begin(void) {
+	thread_alloc.peak = thread_alloc.in_use;
+	return thread_alloc.in_use;
+}
+
+static void thread_alloc_end(RectilinearizeStats *stats, uint64_t calls, int64_t in_use) {
+	stats->allocations += thread_alloc.calls - calls;
+	uint64_t peak = (uint64_t) (thread_alloc.peak - in_use);
+	if (peak > stats->peak_bytes) {
+		stats->peak_bytes = peak;
+	}
+}
+
+static RectilinearizeStageHook stage_hook;
+static void *stage_hook_user;
+
+void rectilinearize_set_stage_hook(RectilinearizeStageHook hook, void *user) {
+	stage_hook = hook;
+	stage_hook_user = user;
+}
+
+// Reads the clock at the boundary of two stages and tells the stage hook which one starts
+static uint64_t stats_enter(RectilinearizeStage stage) {
+	uint64_t now = stats_clock();
+	if (stage_hook != NULL) {
+		stage_hook(stage, stage_hook_user);
+	}
+	return now;
+}
 
 static bool is_corner_pixel(const Image *img, int x, int y) {
 	int w = img->width;
@@ -117,9 +294,10 @@ typedef struct RectilinearPoint {
 	int x, y;
 } RectilinearPoint;
 
-static void extract_polygon(Image *img, RectilinearPoint **points) {
-	for(int y = 0; y < img->height; y++) {
-		for(int x = 0; x < img->width; x++) {
+// Appends every corner pixel in the rectangle from ('x0', 'y0') up to ('x1', 'y1') to 'points' in scan order
+static void extract_corners(const Image *img, int x0, int y0, int x1, int y1, RectilinearPoint **points) {
+	for(int y = y0; y < y1; y++) {
+		for(int x = x0; x < x1; x++) {
 			// Check if the pixel is transparent
 			if (img->data[INDEX_IMGP(img, x, y) + 3] == 0) {
 				continue;
@@ -133,12 +311,17 @@ static void extract_polygon(Image *img, RectilinearPoint **points) {
 	}
 }
 
+static void extract_polygon(Image *img, RectilinearPoint **points) {
+	extract_corners(img, 0, 0, img->width, img->height, points);
+}
+
 typedef struct Edge {
 	RectilinearPoint key, value;
 } Edge;
 
-static Edge *get_edges(RectilinearPoint *points, size_t point_count, bool cmp_by_x) {
-	Edge *map = NULL;
+// Pairs up the corners of every row in 'points', or of every column with 'cmp_by_x', and adds the edges between them
+// to 'map' in both directions. 'points' has to hold whole rows or columns
+static Edge *add_edges(Edge *map, const RectilinearPoint *points, size_t point_count, bool cmp_by_x) {
 	for (size_t i = 0; i < point_count;) {
 		size_t last_idx = point_count;
 		for (size_t j = i; j < point_count; ++j) {
@@ -149,11 +332,11 @@ static Edge *get_edges(RectilinearPoint *points, size_t point_count, bool cmp_by
 		}
 
 		bool in_edge = false;
-		RectilinearPoint *first_point = NULL;
+		const RectilinearPoint *first_point = NULL;
 		for (size_t j = i; j < last_idx; ++j) {
 			if (in_edge) {
-				hmput(map, *first_point, points[j]);
-				hmput(map, points[j], *first_point);
+				hmput_locked(map, *first_point, points[j]);
+				hmput_locked(map, points[j], *first_point);
 				in_edge = false;
 			} else {
 				first_point = points + j;
@@ -167,45 +350,96 @@ static Edge *get_edges(RectilinearPoint *points, size_t point_count, bool cmp_by
 	return map;
 }
 
-static bool sort_by_x = true;
-static int is_less_by_axis(const void *_a, const void *_b) {
+// Two separate comparators instead of a flag so concurrent calls do not race on shared state
+static int is_less_by_x(const void *_a, const void *_b) {
 	RectilinearPoint a = *((RectilinearPoint *) _a); RectilinearPoint b = *((RectilinearPoint *) _b);
-	if (sort_by_x)
-		return a.x == b.x ? a.y - b.y : a.x - b.x;
-	else
-		return a.y == b.y ? a.x - b.x : a.y - b.y;
+	return a.x == b.x ? a.y - b.y : a.x - b.x;
 }
 
-void rectilinearize_image(unsigned char *data, int width, int height, int **points, size_t *point_count) {
-	RectilinearPoint *rect_points = NULL;
+static int is_less_by_y(const void *_a, const void *_b) {
+	RectilinearPoint a = *((RectilinearPoint *) _a); RectilinearPoint b = *((RectilinearPoint *) _b);
+	return a.y == b.y ? a.x - b.x : a.y - b.y;
+}
 
-	Image img = {
-		.data = data, .width = width, .height = height, .channels = 4
-	};
-	extract_polygon(&img, &rect_points);
+// Directory of the result cache, NULL while caching is disabled
+static char *cache_dir = NULL;
 
-	if (rect_points == NULL) {
-		return;
-	}
+// Seeds that keep keys of raw files and of decoded pixels apart
+#define CACHE_FILE_SEED  0x52504c5946494c45ull
+#define CACHE_PIXEL_SEED 0x52504c5950495845ull
 
-	// Final sorted points
-	RectilinearPoint *sorted_points = NULL;
-	arrput(sorted_points, rect_points[0]);
+static const uint64_t hash_primes[5] = {
+	0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x85EBCA77C2B2AE63ull, 0x27D4EB2F165667C5ull,
+};
 
-	sort_by_x = false;
-	qsort(rect_points, arrlenu(rect_points), sizeof *rect_points, is_less_by_axis);
-	Edge *h_edges = get_edges(rect_points, arrlenu(rect_points), false);
-	if (h_edges == NULL) {
-		return;
+static uint64_t rotl64(uint64_t v, int r) {
+	return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t load_u64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t v) {
+	return rotl64(acc + v * hash_primes[1], 31) * hash_primes[0];
+}
+
+// 64-bit hash in the style of XXH64. Four independent lanes consume 32 bytes per iteration, which hashes a decoded
+// image far faster than it can be scanned.
+static uint64_t hash_bytes(const unsigned char *data, size_t size, uint64_t seed) {
+	const unsigned char *p = data;
+	const unsigned char *end = data + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t lanes[4] = {
+			seed + hash_primes[0] + hash_primes[1], seed + hash_primes[1], seed, seed - hash_primes[0],
+		};
+		for (; end - p >= 32; p += 32) {
+			lanes[0] = hash_round(lanes[0], load_u64(p));
+			lanes[1] = hash_round(lanes[1], load_u64(p + 8));
+			lanes[2] = hash_round(lanes[2], load_u64(p + 16));
+			lanes[3] = hash_round(lanes[3], load_u64(p + 24));
+		}
+
+		h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+		for (int i = 0; i < 4; ++i) {
+			h = (h ^ hash_round(0, lanes[i])) * hash_primes[0] + hash_primes[3];
+		}
+	} else {
+		h = seed + hash_primes[4];
+	}
+
+	h += size;
+	for (; end - p >= 8; p += 8) {
+		h = rotl64(h ^ hash_round(0, load_u64(p)), 27) * hash_primes[0] + hash_primes[3];
+	}
+	for (; p < end; ++p) {
+		h = rotl64(h ^ (*p * hash_primes[4]), 11) * hash_primes[0];
 	}
 
-	sort_by_x = true;
-	qsort(rect_points, arrlenu(rect_points), sizeof *rect_points, is_less_by_axis);
-	Edge *v_edges = get_edges(rect_points, arrlenu(rect_points), true);
-	if (v_edges == NULL) {
+	h ^= h >> 33;
+	h *= hash_primes[1];
+	h ^= h >> 29;
+	h *= hash_primes[2];
+	h ^= h >> 32;
+	return h;
+}
+
+// Follows the edges from 'start', alternating between a horizontal and a vertical edge, until it is back at 'start'
+static void walk_edges(RectilinearPoint start, Edge *h_edges, Edge *v_edges, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	if (hmlenu(h_edges) == 0 || hmlenu(v_edges) == 0) {
 		return;
 	}
 
+	uint64_t t0 = STATS_ON(stats) ? stats_clock() : 0;
+
+	// Final sorted points
+	RectilinearPoint *sorted_points = NULL;
+	arrput(sorted_points, start);
+
 	bool is_y_axis = true;
 	while (true) {
 		RectilinearPoint next_point;
@@ -223,10 +457,17 @@ void rectilinearize_image(unsigned char *data, int width, int height, int **poin
 		is_y_axis = !is_y_axis;
 	}
 
+	if (STATS_ON(stats)) {
+		stats->walk_ns += stats_enter(RECTILINEARIZE_STAGE_NONE) - t0;
+		stats->hash_probes += arrlenu(sorted_points);
+		stats->bytes_allocated += sizeof *sorted_points * arrcap(sorted_points) + sizeof(int) * (arrlenu(sorted_points) << 1);
+	}
+
 	if (points && point_count) {
 		size_t p_count = arrlenu(sorted_points);
 		int *p = malloc(sizeof *p * (p_count << 1));
 		if (p == NULL) {
+			arrfree(sorted_points);
 			return;
 		}
 		for (size_t i = 0; i < p_count; ++i) {
@@ -237,110 +478,1193 @@ void rectilinearize_image(unsigned char *data, int width, int height, int **poin
 		*points = p;
 		*point_count = p_count;
 	}
+
+	arrfree(sorted_points);
 }
 
-void rectilinearize_file(const char *filename, int **points, size_t *point_count) {
+// Orders the corners found by `extract_polygon` into the vertices of the polygon. 'corners' is sorted in place
+static void walk_corners(RectilinearPoint *corners, size_t corner_count, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	if (corner_count == 0) {
+		return;
+	}
+
+	RectilinearPoint start = corners[0];
+
+	uint64_t t0 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_SORT_Y) : 0;
+	qsort(corners, corner_count, sizeof *corners, is_less_by_y);
+	uint64_t t1 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_EDGES) : 0;
+	Edge *h_edges = add_edges(NULL, corners, corner_count, false);
+
+	uint64_t t2 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_SORT_X) : 0;
+	qsort(corners, corner_count, sizeof *corners, is_less_by_x);
+	uint64_t t3 = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_EDGES) : 0;
+	Edge *v_edges = add_edges(NULL, corners, corner_count, true);
+
+	if (STATS_ON(stats)) {
+		uint64_t t4 = stats_enter(RECTILINEARIZE_STAGE_WALK);
+		stats->sort_y_ns += t1 - t0;
+		stats->sort_x_ns += t3 - t2;
+		stats->edges_ns += (t2 - t1) + (t4 - t3);
+		stats->corners += corner_count;
+		stats->edges += (hmlenu(h_edges) + hmlenu(v_edges)) >> 1;
+		stats->hash_probes += hmlenu(h_edges) + hmlenu(v_edges);
+		stats->bytes_allocated += sizeof(Edge) * (arrcap(h_edges) + arrcap(v_edges));
+	}
+
+	walk_edges(start, h_edges, v_edges, points, point_count, stats);
+	hmfree(h_edges);
+	hmfree(v_edges);
+}
+
+static void extract_points(unsigned char *data, int width, int height, int stride, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	RectilinearPoint *rect_points = NULL;
+
+	Image img = {
+		.data = data, .width = width, .height = height, .channels = 4, .stride = stride
+	};
+	uint64_t start = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_SCAN) : 0;
+	extract_polygon(&img, &rect_points);
+	if (STATS_ON(stats)) {
+		stats->scan_ns += stats_enter(RECTILINEARIZE_STAGE_NONE) - start;
+		stats->pixels += (uint64_t) width * (uint64_t) height;
+		stats->bytes_allocated += sizeof *rect_points * arrcap(rect_points);
+	}
+
+	walk_corners(rect_points, arrlenu(rect_points), points, point_count, stats);
+	arrfree(rect_points);
+}
+
+void rectilinearize_image(unsigned char *data, int width, int height, int **points, size_t *point_count) {
+	if (cache_dir == NULL) {
+		extract_points(data, width, height, width, points, point_count, NULL);
+		return;
+	}
+
+	uint64_t seed = CACHE_PIXEL_SEED ^ ((uint64_t) (uint32_t) width << 32 | (uint32_t) height);
+	uint64_t key = hash_bytes(data, (size_t) width * (size_t) height * 4, seed);
+	int *p = NULL;
+	size_t p_count = 0;
+	if (!rectilinearize_cache_load(key, &p, &p_count, NULL, NULL)) {
+		extract_points(data, width, height, width, &p, &p_count, NULL);
+		rectilinearize_cache_store(key, p, p_count, width, height);
+	}
+
+	if (points && point_count) {
+		*points = p;
+		*point_count = p_count;
+	} else {
+		free(p);
+	}
+}
+
+void rectilinearize_image_view(unsigned char *data, int width, int height, int stride, int **points, size_t *point_count) {
+	// Only contiguous images can be hashed in one go, views skip the cache
+	if (stride == width) {
+		rectilinearize_image(data, width, height, points, point_count);
+	} else {
+		extract_points(data, width, height, stride, points, point_count, NULL);
+	}
+}
+
+void rectilinearize_image_stats(unsigned char *data, int width, int height, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	uint64_t calls = thread_alloc.calls;
+	int64_t in_use = thread_alloc_begin();
+	extract_points(data, width, height, width, points, point_count, stats);
+	if (STATS_ON(stats)) {
+		thread_alloc_end(stats, calls, in_use);
+	}
+}
+
+void rectilinearize_file_stats(const char *filename, int **points, size_t *point_count, RectilinearizeStats *stats) {
+	uint64_t calls = thread_alloc.calls;
+	int64_t in_use = thread_alloc_begin();
+	uint64_t start = STATS_ON(stats) ? stats_enter(RECTILINEARIZE_STAGE_DECODE) : 0;
 	Image img = {0};
 	img.data = stbi_load(filename, &img.width, &img.height, &img.channels, 4);
+	if (STATS_ON(stats)) {
+		stats->decode_ns += stats_enter(RECTILINEARIZE_STAGE_NONE) - start;
+	}
 	if (img.channels != 4) {
+		stbi_image_free(img.data);
+		return;
+	}
+
+	extract_points(img.data, img.width, img.height, img.width, points, point_count, stats);
+	stbi_image_free(img.data);
+	if (STATS_ON(stats)) {
+		thread_alloc_end(stats, calls, in_use);
+	}
+}
+
+struct RectilinearizeResult {
+	int width;
+	int height;
+	RectilinearPoint *corners;      // Every corner pixel of the image in scan order
+	RectilinearPoint *corners_by_x; // The same corners ordered by column
+	Edge *h_edges;                  // The edges between the corners of every row, kept up to date with 'corners'
+	Edge *v_edges;                  // The edges between the corners of every column, kept up to date with 'corners_by_x'
+	int *points;
+	size_t point_count;
+};
+
+// Rebuilds the polygon by walking the edge maps from the first corner in scan order
+static void result_walk(RectilinearizeResult *result) {
+	free(result->points);
+	result->points = NULL;
+	result->point_count = 0;
+
+	if (arrlenu(result->corners) > 0) {
+		walk_edges(result->corners[0], result->h_edges, result->v_edges, &result->points, &result->point_count, NULL);
+	}
+}
+
+RectilinearizeResult *rectilinearize_result_create(unsigned char *data, int width, int height) {
+	RectilinearizeResult *result = calloc(1, sizeof *result);
+	if (result == NULL) {
+		return NULL;
+	}
+	result->width = width;
+	result->height = height;
+
+	Image img = {
+		.data = data, .width = width, .height = height, .channels = 4, .stride = width
+	};
+	extract_polygon(&img, &result->corners);
+
+	size_t corner_count = arrlenu(result->corners);
+	arrsetlen(result->corners_by_x, corner_count);
+	if (corner_count > 0) {
+		memcpy(result->corners_by_x, result->corners, sizeof *result->corners * corner_count);
+	}
+	qsort(result->corners_by_x, corner_count, sizeof *result->corners_by_x, is_less_by_x);
+	result->h_edges = add_edges(NULL, result->corners, corner_count, false);
+	result->v_edges = add_edges(NULL, result->corners_by_x, corner_count, true);
+	result_walk(result);
+	return result;
+}
+
+// Index of the first corner at or after row 'line', or column 'line' in corners ordered by column with 'by_x'
+static size_t first_corner_of_line(const RectilinearPoint *corners, size_t corner_count, int line, bool by_x) {
+	size_t lo = 0, hi = corner_count;
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) >> 1);
+		if ((by_x ? corners[mid].x : corners[mid].y) < line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Replaces the corners between 'begin' and 'end' that lie within ['lo', 'hi') along the lines with 'fresh', which is
+// in the same order as 'corners'. Corners are ordered by row, or by column with 'by_x'. Returns where the lines end now
+static size_t splice_corners(RectilinearPoint **corners, size_t begin, size_t end, const RectilinearPoint *fresh, size_t fresh_count, int lo, int hi, bool by_x) {
+	int (*cmp)(const void *, const void *) = by_x ? is_less_by_x : is_less_by_y;
+	RectilinearPoint *old = *corners;
+	RectilinearPoint *lines = NULL;
+	arrsetcap(lines, end - begin + fresh_count);
+
+	size_t f = 0;
+	for (size_t i = begin; i < end; ++i) {
+		int along = by_x ? old[i].y : old[i].x;
+		if (along >= lo && along < hi) {
+			continue;
+		}
+		while (f < fresh_count && cmp(&fresh[f], &old[i]) < 0) {
+			arrput(lines, fresh[f++]);
+		}
+		arrput(lines, old[i]);
+	}
+	while (f < fresh_count) {
+		arrput(lines, fresh[f++]);
+	}
+
+	// Only the corners after the lines move, and only when their number changed
+	size_t count = arrlenu(lines);
+	size_t total = arrlenu(old);
+	if (count > end - begin) {
+		arrsetlen(*corners, total + count - (end - begin));
+	}
+	if (count != end - begin && total > end) {
+		memmove(*corners + begin + count, *corners + end, sizeof **corners * (total - end));
+	}
+	if (count < end - begin) {
+		arrsetlen(*corners, total - ((end - begin) - count));
+	}
+	if (count > 0) {
+		memcpy(*corners + begin, lines, sizeof *lines * count);
+	}
+	arrfree(lines);
+	return begin + count;
+}
+
+void rectilinearize_result_update(RectilinearizeResult *result, unsigned char *data, int x, int y, int width, int height) {
+	// Whether a pixel is a corner only depends on its 8 neighbors, so a one pixel halo around the changed pixels covers
+	// every corner that could have appeared or disappeared
+	int x0 = x - 1 > 0 ? x - 1 : 0;
+	int y0 = y - 1 > 0 ? y - 1 : 0;
+	int x1 = x + width + 1 < result->width ? x + width + 1 : result->width;
+	int y1 = y + height + 1 < result->height ? y + height + 1 : result->height;
+	if (width <= 0 || height <= 0 || x0 >= x1 || y0 >= y1) {
+		return;
+	}
+
+	Image img = {
+		.data = data, .width = result->width, .height = result->height, .channels = 4, .stride = result->width
+	};
+	RectilinearPoint *fresh = NULL;
+	extract_corners(&img, x0, y0, x1, y1, &fresh);
+	size_t fresh_count = arrlenu(fresh);
+
+	// Corners are paired up by their position within a row or column, so the edges of every rescanned row and column
+	// are dropped and paired up again once the fresh corners took the place of the old ones
+	size_t corner_count = arrlenu(result->corners);
+	size_t row_begin = first_corner_of_line(result->corners, corner_count, y0, false);
+	size_t row_end = first_corner_of_line(result->corners, corner_count, y1, false);
+	size_t column_begin = first_corner_of_line(result->corners_by_x, corner_count, x0, true);
+	size_t column_end = first_corner_of_line(result->corners_by_x, corner_count, x1, true);
+	for (size_t i = row_begin; i < row_end; ++i) {
+		(void) hmdel(result->h_edges, result->corners[i]);
+	}
+	for (size_t i = column_begin; i < column_end; ++i) {
+		(void) hmdel(result->v_edges, result->corners_by_x[i]);
+	}
+
+	row_end = splice_corners(&result->corners, row_begin, row_end, fresh, fresh_count, x0, x1, false);
+	if (fresh_count > 1) {
+		qsort(fresh, fresh_count, sizeof *fresh, is_less_by_x);
+	}
+	column_end = splice_corners(&result->corners_by_x, column_begin, column_end, fresh, fresh_count, y0, y1, true);
+	arrfree(fresh);
+
+	result->h_edges = add_edges(result->h_edges, result->corners + row_begin, row_end - row_begin, false);
+	result->v_edges = add_edges(result->v_edges, result->corners_by_x + column_begin, column_end - column_begin, true);
+	result_walk(result);
+}
+
+const int *rectilinearize_result_points(const RectilinearizeResult *result, size_t *point_count) {
+	*point_count = result->point_count;
+	return result->points;
+}
+
+void rectilinearize_result_free(RectilinearizeResult *result) {
+	if (result == NULL) {
+		return;
+	}
+	arrfree(result->corners);
+	arrfree(result->corners_by_x);
+	hmfree(result->h_edges);
+	hmfree(result->v_edges);
+	free(result->points);
+	free(result);
+}
+
+// Reads the whole file into memory, the cache key of a file is the hash of its raw bytes
+static unsigned char *read_file(const char *filename, size_t *size) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+
+	unsigned char *data = NULL;
+	long length = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+	if (length > 0 && fseek(f, 0, SEEK_SET) == 0 && (data = malloc((size_t) length)) != NULL) {
+		*size = fread(data, 1, (size_t) length, f);
+		if (*size != (size_t) length) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(f);
+	return data;
+}
+
+void rectilinearize_file(const char *filename, int **points, size_t *point_count) {
+	Image img = {0};
+	if (cache_dir == NULL) {
+		img.data = stbi_load(filename, &img.width, &img.height, &img.channels, 4);
+		if (img.channels != 4) {
+			stbi_image_free(img.data);
+			return;
+		}
+
+		rectilinearize_image(img.data, img.width, img.height, points, point_count);
+		stbi_image_free(img.data);
+		return;
+	}
+
+	size_t size = 0;
+	unsigned char *file = read_file(filename, &size);
+	if (file == NULL || size > INT_MAX) {
+		free(file);
+		return;
+	}
+
+	// Hashing the raw bytes is cheaper than decoding the png, so check those first
+	uint64_t key = rectilinearize_cache_key(file, size);
+	int *p = NULL;
+	size_t p_count = 0;
+	if (!rectilinearize_cache_load(key, &p, &p_count, NULL, NULL)) {
+		img.data = stbi_load_from_memory(file, (int) size, &img.width, &img.height, &img.channels, 4);
+		if (img.channels != 4) {
+			stbi_image_free(img.data);
+			free(file);
+			return;
+		}
+
+		// Only the key of the file is stored, hashing the pixels for a second entry would never pay off
+		extract_points(img.data, img.width, img.height, img.width, &p, &p_count, NULL);
+		stbi_image_free(img.data);
+		rectilinearize_cache_store(key, p, p_count, img.width, img.height);
+	}
+	free(file);
+
+	if (points && point_count) {
+		*points = p;
+		*point_count = p_count;
+	} else {
+		free(p);
+	}
+}
+
+#ifndef _WIN32
+void rectilinearize_set_cache_dir(const char *dir) {
+	free(cache_dir);
+	cache_dir = dir != NULL ? strdup(dir) : NULL;
+}
+#else
+// Entries are mapped and renamed into place with POSIX calls, so the cache stays disabled on Windows
+void rectilinearize_set_cache_dir(const char *dir) {
+	(void) dir;
+}
+#endif
+
+uint64_t rectilinearize_cache_key(const unsigned char *data, size_t size) {
+	return hash_bytes(data, size, CACHE_FILE_SEED);
+}
+
+#ifndef _WIN32
+// Cache entries are named after their key, e.g. "<dir>/0123456789abcdef.bin". NULL when no cache directory is set
+static char *cache_entry_path(uint64_t key) {
+	if (cache_dir == NULL) {
+		return NULL;
+	}
+
+	size_t size = strlen(cache_dir) + 1 + 16 + sizeof ".bin";
+	char *path = malloc(size);
+	if (path != NULL) {
+		snprintf(path, size, "%s/%016llx.bin", cache_dir, (unsigned long long) key);
+	}
+	return path;
+}
+
+bool rectilinearize_cache_load(uint64_t key, int **points, size_t *point_count, int *width, int *height) {
+	char *path = cache_entry_path(key);
+	if (path == NULL) {
+		return false;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0) {
+		return false;
+	}
+
+	bool found = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			found = rectilinearize_bin_decode(map, (size_t) st.st_size, points, point_count, width, height);
+			munmap(map, (size_t) st.st_size);
+		}
+	}
+
+	close(fd);
+	return found;
+}
+
+// Writes 'data' to a temporary file next to 'path' and renames it into place, so concurrent readers and writers of
+// the same cache entry never see a partial file
+static void write_file_atomic(const char *path, const unsigned char *data, size_t size) {
+	char *tmp_path = malloc(strlen(path) + sizeof ".XXXXXX");
+	if (tmp_path == NULL) {
+		return;
+	}
+
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		free(tmp_path);
+		return;
+	}
+	fchmod(fd, 0644); // `mkstemp` creates the file only readable by its owner
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t n = write(fd, data + written, size - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		written += (size_t) n;
+	}
+
+	if (close(fd) != 0 || written != size || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+}
+
+void rectilinearize_cache_store(uint64_t key, const int *points, size_t point_count, int width, int height) {
+	char *path = cache_entry_path(key);
+	if (path == NULL) {
 		return;
 	}
 
-	rectilinearize_image(img.data, img.width, img.height, points, point_count);
+	size_t size = rectilinearize_bin_encode(points, point_count, width, height, NULL);
+	unsigned char *data = malloc(size);
+	if (data != NULL) {
+		rectilinearize_bin_encode(points, point_count, width, height, data);
+		write_file_atomic(path, data, size);
+	}
+
+	free(data);
+	free(path);
+}
+#else
+bool rectilinearize_cache_load(uint64_t key, int **points, size_t *point_count, int *width, int *height) {
+	(void) key;
+	(void) points;
+	(void) point_count;
+	(void) width;
+	(void) height;
+	return false;
+}
+
+void rectilinearize_cache_store(uint64_t key, const int *points, size_t point_count, int width, int height) {
+	(void) key;
+	(void) points;
+	(void) point_count;
+	(void) width;
+	(void) height;
+}
+#endif // _WIN32
+
+static void put_u16_le(unsigned char *p, uint16_t v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+}
+
+static void put_u32_le(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
+}
+
+static uint16_t get_u16_le(const unsigned char *p) {
+	return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32_le(const unsigned char *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+size_t rectilinearize_bin_encode(const int *points, size_t point_count, int width, int height, unsigned char *out) {
+	uint32_t ring_count = point_count > 0 ? 1 : 0;
+	// Vertices lie on pixel boundaries, so a shape touching the right edge of the image has its x equal to 'width'
+	bool is_u16 = width <= UINT16_MAX && height <= UINT16_MAX;
+	size_t coord_size = is_u16 ? sizeof(uint16_t) : sizeof(int32_t);
+
+	// Pad the coordinates so the file stays a multiple of 4 bytes, which keeps concatenated polygons aligned
+	size_t coords_size = ((point_count << 1) * coord_size + 3) & ~(size_t) 3;
+	size_t size = sizeof(RectilinearizeBinHeader) + ring_count * sizeof(uint32_t) + coords_size;
+	if (out == NULL) {
+		return size;
+	}
+
+	memcpy(out, RECTILINEARIZE_BIN_MAGIC, 4);
+	put_u16_le(out + offsetof(RectilinearizeBinHeader, version), RECTILINEARIZE_BIN_VERSION);
+	put_u16_le(out + offsetof(RectilinearizeBinHeader, flags), is_u16 ? RECTILINEARIZE_BIN_U16 : 0);
+	put_u32_le(out + offsetof(RectilinearizeBinHeader, width), (uint32_t) width);
+	put_u32_le(out + offsetof(RectilinearizeBinHeader, height), (uint32_t) height);
+	put_u32_le(out + offsetof(RectilinearizeBinHeader, ring_count), ring_count);
+
+	unsigned char *p = out + sizeof(RectilinearizeBinHeader);
+	if (ring_count > 0) {
+		put_u32_le(p, (uint32_t) point_count);
+		p += sizeof(uint32_t);
+	}
+
+	for (size_t i = 0; i < (point_count << 1); ++i) {
+		if (is_u16) {
+			put_u16_le(p, (uint16_t) points[i]);
+		} else {
+			put_u32_le(p, (uint32_t) points[i]);
+		}
+		p += coord_size;
+	}
+	memset(p, 0, (size_t) (out + size - p));
+
+	return size;
+}
+
+bool rectilinearize_bin_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height) {
+	if (size < sizeof(RectilinearizeBinHeader) || memcmp(data, RECTILINEARIZE_BIN_MAGIC, 4) != 0
+		|| get_u16_le(data + offsetof(RectilinearizeBinHeader, version)) != RECTILINEARIZE_BIN_VERSION) {
+		return false;
+	}
+
+	bool is_u16 = get_u16_le(data + offsetof(RectilinearizeBinHeader, flags)) & RECTILINEARIZE_BIN_U16;
+	size_t coord_size = is_u16 ? sizeof(uint16_t) : sizeof(int32_t);
+	size_t ring_count = get_u32_le(data + offsetof(RectilinearizeBinHeader, ring_count));
+	const unsigned char *p = data + sizeof(RectilinearizeBinHeader);
+	if (ring_count > (size - sizeof(RectilinearizeBinHeader)) / sizeof(uint32_t)) {
+		return false;
+	}
+
+	size_t p_count = 0;
+	for (size_t i = 0; i < ring_count; ++i) {
+		p_count += get_u32_le(p);
+		p += sizeof(uint32_t);
+	}
+
+	if (p_count > (size_t) (data + size - p) / (coord_size << 1)) {
+		return false;
+	}
+
+	int *result = malloc(sizeof *result * ((p_count << 1) > 0 ? (p_count << 1) : 1));
+	if (result == NULL) {
+		return false;
+	}
+
+	for (size_t i = 0; i < (p_count << 1); ++i) {
+		result[i] = is_u16 ? get_u16_le(p) : (int) get_u32_le(p);
+		p += coord_size;
+	}
+
+	*points = result;
+	*point_count = p_count;
+	if (width) {
+		*width = (int) get_u32_le(data + offsetof(RectilinearizeBinHeader, width));
+	}
+	if (height) {
+		*height = (int) get_u32_le(data + offsetof(RectilinearizeBinHeader, height));
+	}
+	return true;
+}
+
+// Writes 'v' as an LEB128 varint into 'out' if it is not NULL and returns the number of bytes it takes
+static size_t put_varint(unsigned char *out, uint64_t v) {
+	size_t n = 0;
+	do {
+		unsigned char byte = (unsigned char) (v & 0x7f);
+		v >>= 7;
+		if (out) {
+			out[n] = byte | (v ? 0x80 : 0);
+		}
+		n += 1;
+	} while (v);
+	return n;
+}
+
+static bool get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+	uint64_t result = 0;
+	for (unsigned shift = 0; shift < 64 && *p < end; shift += 7) {
+		unsigned char byte = *(*p)++;
+		result |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t zigzag_encode(int64_t v) {
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+size_t rectilinearize_varint_encode(const int *points, size_t point_count, int width, int height, unsigned char *out) {
+	size_t ring_count = point_count > 0 ? 1 : 0;
+	bool first_is_vertical = point_count > 1 && points[0] == points[2];
+
+	size_t n = 4;
+	if (out) {
+		memcpy(out, RECTILINEARIZE_VARINT_MAGIC, 4);
+	}
+	n += put_varint(out ? out + n : NULL, RECTILINEARIZE_VARINT_VERSION);
+	n += put_varint(out ? out + n : NULL, (uint64_t) width);
+	n += put_varint(out ? out + n : NULL, (uint64_t) height);
+	n += put_varint(out ? out + n : NULL, ring_count);
+	if (ring_count == 0) {
+		return n;
+	}
+
+	n += put_varint(out ? out + n : NULL, (uint64_t) point_count << 1 | first_is_vertical);
+	n += put_varint(out ? out + n : NULL, (uint64_t) points[0]);
+	n += put_varint(out ? out + n : NULL, (uint64_t) points[1]);
+
+	bool is_vertical = first_is_vertical;
+	for (size_t i = 1; i < point_count; ++i) {
+		int fixed = is_vertical ? points[(i << 1)] - points[(i << 1) - 2] : points[(i << 1) + 1] - points[(i << 1) - 1];
+		if (fixed != 0) {
+			return 0;
+		}
+
+		int64_t delta = is_vertical
+			? (int64_t) points[(i << 1) + 1] - points[(i << 1) - 1]
+			: (int64_t) points[(i << 1)] - points[(i << 1) - 2];
+		n += put_varint(out ? out + n : NULL, zigzag_encode(delta));
+		is_vertical = !is_vertical;
+	}
+
+	return n;
+}
+
+// Walks the rings of a delta + varint stream starting at 'p'. Only counts the vertices when 'out' is NULL
+static bool varint_decode_rings(const unsigned char *p, const unsigned char *end, uint64_t ring_count, int *out, size_t *point_count) {
+	size_t n = 0;
+	for (uint64_t r = 0; r < ring_count; ++r) {
+		uint64_t ring_header, x, y;
+		if (!get_varint(&p, end, &ring_header) || !get_varint(&p, end, &x) || !get_varint(&p, end, &y)
+			|| (ring_header >> 1) == 0 || (ring_header >> 1) - 1 > (uint64_t) (end - p)) {
+			return false;
+		}
+
+		int64_t px = (int64_t) x, py = (int64_t) y;
+		if (out) {
+			out[(n << 1)]     = (int) px;
+			out[(n << 1) + 1] = (int) py;
+		}
+		n += 1;
+
+		bool is_vertical = ring_header & 1;
+		for (uint64_t i = 1; i < (ring_header >> 1); ++i) {
+			uint64_t delta;
+			if (!get_varint(&p, end, &delta)) {
+				return false;
+			}
+
+			if (is_vertical) {
+				py += zigzag_decode(delta);
+			} else {
+				px += zigzag_decode(delta);
+			}
+			if (out) {
+				out[(n << 1)]     = (int) px;
+				out[(n << 1) + 1] = (int) py;
+			}
+			n += 1;
+			is_vertical = !is_vertical;
+		}
+	}
+
+	*point_count = n;
+	return true;
+}
+
+bool rectilinearize_varint_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height) {
+	const unsigned char *p = data + 4;
+	const unsigned char *end = data + size;
+	uint64_t version, w, h, ring_count;
+	if (size < 4 || memcmp(data, RECTILINEARIZE_VARINT_MAGIC, 4) != 0
+		|| !get_varint(&p, end, &version) || version != RECTILINEARIZE_VARINT_VERSION
+		|| !get_varint(&p, end, &w) || !get_varint(&p, end, &h) || !get_varint(&p, end, &ring_count)) {
+		return false;
+	}
+
+	// First pass validates the stream and sizes the output so the second one can decode in place
+	size_t p_count;
+	if (!varint_decode_rings(p, end, ring_count, NULL, &p_count)) {
+		return false;
+	}
+
+	int *xy = malloc(sizeof *xy * ((p_count << 1) > 0 ? (p_count << 1) : 1));
+	if (xy == NULL) {
+		return false;
+	}
+	varint_decode_rings(p, end, ring_count, xy, &p_count);
+
+	*points = xy;
+	*point_count = p_count;
+	if (width) {
+		*width = (int) w;
+	}
+	if (height) {
+		*height = (int) h;
+	}
+	return true;
 }
 
 #ifdef BINARY
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "output.h"
+#include "pipeline.h"
+#include "serve.h"
+#include "trace.h"
+
+typedef struct {
+	Output_Format format;
+	Cstr output_dir; // Write one file per input into this directory instead of stdout
+	Cstr_Array names; // Path of every input relative to the directory argument it was found in, or its basename
+	size_t next;      // Index in 'names' of the next item, the pipeline hands them over in input order
+	Writer writer;   // Shared by every output file so the buffer is only allocated once
+	Dedup *dedup;    // Collect the polygons and write the unique shapes once all inputs are done
+	size_t failed;   // Number of inputs that could not be processed
+
+	bool print_stats;          // Print the totals of `stats` once all inputs are done
+	RectilinearizeStats stats; // Sum of the stats of every input
+	size_t stats_count;        // Number of inputs that were decoded and extracted
+} Output;
+
+// Files found in a directory argument keep their path relative to it, so `a/x.png` and `b/x.png` do not collide
+static Cstr output_path(const Output *output, Cstr name) {
+	return PATH(output->output_dir, CONCAT(NOEXT(name), output_format_extension(output->format)));
+}
+
+// Drops the inputs whose output file is newer than the input itself, the same way `nobuild` skips up to date objects
+static Cstr_Array drop_up_to_date(Cstr_Array inputs, Output *output) {
+	Cstr_Array stale = {0};
+	Cstr_Array names = {0};
+	for (size_t i = 0; i < inputs.count; ++i) {
+		// Missing inputs are kept so they are reported as failures
+		if (!PATH_EXISTS(inputs.elems[i]) || IS_NEWER(inputs.elems[i], output_path(output, output->names.elems[i]))) {
+			stale = cstr_array_append(stale, inputs.elems[i]);
+			names = cstr_array_append(names, output->names.elems[i]);
+		}
+	}
+
+	if (stale.count < inputs.count) {
+		INFO("Skipping %zu up to date inputs", inputs.count - stale.count);
+	}
+	free(inputs.elems);
+	free(output->names.elems);
+	output->names = names;
+	return stale;
+}
+
+static void add_stats(RectilinearizeStats *total, const RectilinearizeStats *stats) {
+	total->decode_ns += stats->decode_ns;
+	total->scan_ns += stats->scan_ns;
+	total->sort_y_ns += stats->sort_y_ns;
+	total->sort_x_ns += stats->sort_x_ns;
+	total->edges_ns += stats->edges_ns;
+	total->walk_ns += stats->walk_ns;
+	total->pixels += stats->pixels;
+	total->corners += stats->corners;
+	total->edges += stats->edges;
+	total->hash_probes += stats->hash_probes;
+	total->bytes_allocated += stats->bytes_allocated;
+	total->allocations += stats->allocations;
+	if (stats->peak_bytes > total->peak_bytes) {
+		total->peak_bytes = stats->peak_bytes;
+	}
+}
+
+static void print_stats(const RectilinearizeStats *stats, size_t count) {
+	const struct { const char *name; uint64_t ns; } stages[] = {
+		{ "decode", stats->decode_ns }, { "scan", stats->scan_ns }, { "sort by y", stats->sort_y_ns },
+		{ "sort by x", stats->sort_x_ns }, { "edges", stats->edges_ns }, { "walk", stats->walk_ns },
+	};
+
+	uint64_t total_ns = 0;
+	for (size_t i = 0; i < sizeof stages / sizeof *stages; ++i) {
+		total_ns += stages[i].ns;
+	}
+
+	fprintf(stderr, "%zu images\n", count);
+	for (size_t i = 0; i < sizeof stages / sizeof *stages; ++i) {
+		fprintf(stderr, "  %-12s %12.3f ms %6.1f%%\n", stages[i].name, (double) stages[i].ns / 1e6,
+			total_ns > 0 ? 100.0 * (double) stages[i].ns / (double) total_ns : 0.0);
+	}
+	fprintf(stderr, "  %-12s %12.3f ms\n", "total", (double) total_ns / 1e6);
+	fprintf(stderr, "  %-12s %12llu\n", "pixels", (unsigned long long) stats->pixels);
+	fprintf(stderr, "  %-12s %12llu\n", "corners", (unsigned long long) stats->corners);
+	fprintf(stderr, "  %-12s %12llu\n", "edges", (unsigned long long) stats->edges);
+	fprintf(stderr, "  %-12s %12llu\n", "hash probes", (unsigned long long) stats->hash_probes);
+	fprintf(stderr, "  %-12s %12llu\n", "bytes", (unsigned long long) stats->bytes_allocated);
+	fprintf(stderr, "  %-12s %12llu\n", "allocations", (unsigned long long) stats->allocations);
+	fprintf(stderr, "  %-12s %12llu\n", "peak bytes", (unsigned long long) stats->peak_bytes);
+
+	// Everything is freed by the time the stats are printed, so whatever is still in use leaked
+	RectilinearizeAllocStats alloc;
+	rectilinearize_alloc_stats(&alloc);
+	fprintf(stderr, "  %-12s %12llu\n", "leaked bytes", (unsigned long long) alloc.bytes_in_use);
+}
+
+// Name of a cell of an atlas or frame of an animation in the output, e.g. "sheet.png#12"
+static Cstr cell_label(Cstr path, size_t cell) {
+	char index[24];
+	snprintf(index, sizeof index, "%zu", cell);
+	return CONCAT(path, "#", index);
+}
+
+// Returns false if any of the polygons could not be encoded in the output format
+static bool write_result(Output *output, const Pipeline_Item *item) {
+	if (item->cells == NULL) {
+		return write_polygon(&output->writer, output->format, item->path, item->points, item->point_count, item->width, item->height);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < item->cell_count; ++i) {
+		const Pipeline_Cell *cell = &item->cells[i];
+		ok = write_polygon(&output->writer, output->format, cell_label(item->path, i), cell->points, cell->point_count, cell->width, cell->height) && ok;
+	}
+	return ok;
+}
+
+// Creates the directories of an output mirroring a subdirectory of its input
+static void make_parent_dirs(Cstr path) {
+	Cstr dir = DIRNAME(path);
+	if (!PATH_EXISTS(dir)) {
+		make_parent_dirs(dir);
+		path_mkdirs(CSTR_ARRAY_MAKE(dir));
+	}
+}
+
+static void write_item(Pipeline_Item *item, void *user) {
+	Output *output = user;
+	Cstr name = output->names.elems[output->next++];
+	if (item->failed) {
+		ERRO("Could not load %s", item->path);
+		output->failed += 1;
+		if (output->format == FORMAT_NDJSON && output->output_dir == NULL) {
+			write_ndjson_error(&output->writer, item->path, "could not load image");
+			writer_flush(&output->writer);
+		}
+		return;
+	}
+
+	// The cells of atlases and frames of animations are extracted without stats, counting them would only dilute the
+	// averages with zeros
+	if (output->print_stats && !item->cached && item->cells == NULL) {
+		add_stats(&output->stats, &item->stats);
+		output->stats_count += 1;
+	}
+
+	if (output->dedup != NULL && item->cells != NULL) {
+		for (size_t i = 0; i < item->cell_count; ++i) {
+			dedup_add(output->dedup, cell_label(item->path, i), item->cells[i].points, item->cells[i].point_count);
+		}
+		return;
+	}
+
+	if (output->dedup != NULL) {
+		dedup_add(output->dedup, item->path, item->points, item->point_count);
+		return;
+	}
+
+	if (item->cells != NULL && !output_format_is_labeled(output->format)) {
+		ERRO("%s has %zu frames, which can only be written together with --format ndjson or geojson", item->path, item->cell_count);
+		output->failed += 1;
+		return;
+	}
+
+	if (output->output_dir == NULL) {
+		if (!write_result(output, item)) {
+			ERRO("Could not encode the polygon of %s", item->path);
+			output->failed += 1;
+		}
+
+		// Hand every record to the kernel as soon as it is done so consumers can stream the results
+		if (output->format == FORMAT_NDJSON) {
+			writer_flush(&output->writer);
+		}
+		return;
+	}
+
+	Cstr out_path = output_path(output, name);
+	make_parent_dirs(out_path);
+	int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERRO("Could not open %s: %s", out_path, strerror(errno));
+		output->failed += 1;
+		return;
+	}
+
+	output->writer.fd = fd;
+	if (!write_result(output, item)) {
+		// An empty output would count as up to date on the next run
+		ERRO("Could not encode the polygon of %s", item->path);
+		output->failed += 1;
+		writer_reset(&output->writer);
+		unlink(out_path);
+	} else if (!writer_flush(&output->writer)) {
+		output->failed += 1;
+		writer_reset(&output->writer);
+	}
+	close(fd);
+}
+
+static int compare_cstr(const void *a, const void *b) {
+	return strcmp(*(const Cstr *) a, *(const Cstr *) b);
+}
+
+// Recursively collects every png and gif file under 'dir_path' in a stable order
+static Cstr_Array collect_dir(Cstr_Array inputs, Cstr dir_path) {
+	DIR *dir = opendir(dir_path);
+	if (dir == NULL) {
+		PANIC("Could not open directory %s: %s", dir_path, strerror(errno));
+	}
+
+	Cstr_Array entries = {0};
+	struct dirent *dp = NULL;
+	while ((dp = readdir(dir)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+			continue;
+		}
+		entries = cstr_array_append(entries, PATH(dir_path, dp->d_name));
+	}
+	closedir(dir);
+
+	if (entries.count > 0) {
+		qsort(entries.elems, entries.count, sizeof *entries.elems, compare_cstr);
+	}
+
+	for (size_t i = 0; i < entries.count; ++i) {
+		if (IS_DIR(entries.elems[i])) {
+			inputs = collect_dir(inputs, entries.elems[i]);
+		} else if (ENDS_WITH(entries.elems[i], ".png") || ENDS_WITH(entries.elems[i], ".gif")) {
+			inputs = cstr_array_append(inputs, entries.elems[i]);
+		}
+	}
+	free(entries.elems);
+
+	return inputs;
+}
+
+// Two inputs writing the same output file would overwrite each other and make the up to date check compare against
+// the output of the wrong input, e.g. `a/x.png b/x.png` or `x.png x.gif`
+static void check_unique_outputs(const Output *output) {
+	Cstr_Array paths = {0};
+	for (size_t i = 0; i < output->names.count; ++i) {
+		paths = cstr_array_append(paths, output_path(output, output->names.elems[i]));
+	}
+
+	if (paths.count > 0) {
+		qsort(paths.elems, paths.count, sizeof *paths.elems, compare_cstr);
+	}
+	for (size_t i = 1; i < paths.count; ++i) {
+		if (strcmp(paths.elems[i - 1], paths.elems[i]) == 0) {
+			PANIC("Several inputs would be written to %s, pass their common directory instead.", paths.elems[i]);
+		}
+	}
+	free(paths.elems);
+}
+
 int main(int argc, char **argv) {
-	const char *filename = NULL;
-	bool svg_output = false;
+	Cstr_Array inputs = {0};
+	Output output = {0};
+	Pipeline_Options options = { .queue_depth = 4, .prefetch = 16 };
+	Dedup dedup = {0};
+	Cstr serve_path = NULL;
+	Cstr cache_directory = NULL;
+	Cstr trace_file = NULL;
+	size_t threads = 0;
+	bool force = false;
 	for (int i = 1; i < argc; ++i) {
 		if (STARTS_WITH(argv[i], "--output-as-svg")) {
-			svg_output = true;
+			output.format = FORMAT_SVG;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--svg-compact")) {
+			output.format = FORMAT_SVG_COMPACT;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--format")) {
+			if (i + 1 >= argc || !output_format_parse(argv[i + 1], &output.format)) {
+				PANIC("--format expects one of json, ndjson, geojson (newline-delimited), wkb, svg, svg-compact, bin "
+					"or varint.");
+			}
+			i += 1;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--output-dir")) {
+			if (i + 1 >= argc) {
+				PANIC("Missing directory argument for --output-dir.");
+			}
+			output.output_dir = argv[++i];
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--queue-depth")) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+				PANIC("--queue-depth expects a positive number.");
+			}
+			options.queue_depth = (size_t) atoi(argv[++i]);
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--prefetch")) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+				PANIC("--prefetch expects a positive number.");
+			}
+			options.prefetch = (size_t) atoi(argv[++i]);
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--atlas")) {
+			if (i + 1 >= argc || sscanf(argv[i + 1], "%dx%d", &options.cell_width, &options.cell_height) != 2
+				|| options.cell_width <= 0 || options.cell_height <= 0) {
+				PANIC("--atlas expects a cell size such as 32x32.");
+			}
+			i += 1;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--trace")) {
+			if (i + 1 >= argc) {
+				PANIC("Missing file argument for --trace.");
+			}
+			trace_file = argv[++i];
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--stats")) {
+			output.print_stats = options.stats = true;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--dedup")) {
+			output.dedup = &dedup;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--force")) {
+			force = true;
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--cache-dir")) {
+			if (i + 1 >= argc) {
+				PANIC("Missing directory argument for --cache-dir.");
+			}
+			cache_directory = argv[++i];
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--serve")) {
+			if (i + 1 >= argc) {
+				PANIC("Missing socket argument for --serve.");
+			}
+			serve_path = argv[++i];
+			continue;
+		}
+
+		if (STARTS_WITH(argv[i], "--threads")) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+				PANIC("--threads expects a positive number.");
+			}
+			threads = (size_t) atoi(argv[++i]);
 			continue;
 		}
 
-		filename = argv[i];
+		if (IS_DIR(argv[i])) {
+			size_t first = inputs.count;
+			inputs = collect_dir(inputs, argv[i]);
+			for (size_t j = first; j < inputs.count; ++j) {
+				output.names = cstr_array_append(output.names, inputs.elems[j] + strlen(argv[i]) + strlen(PATH_SEP));
+			}
+		} else {
+			inputs = cstr_array_append(inputs, argv[i]);
+			output.names = cstr_array_append(output.names, BASENAME(argv[i]));
+		}
+	}
+
+	if (cache_directory != NULL) {
+		if (!PATH_EXISTS(cache_directory)) {
+			path_mkdirs(CSTR_ARRAY_MAKE(cache_directory));
+		}
+		rectilinearize_set_cache_dir(cache_directory);
+		options.use_cache = true;
+	}
+
+	if (trace_file != NULL) {
+		trace_open(trace_file);
+		trace_thread_name("main");
 	}
 
-	if (filename == NULL) {
+	if (serve_path != NULL) {
+		int status = serve(serve_path, threads);
+		return !trace_close() || status != 0;
+	}
+
+	if (inputs.count == 0) {
 		PANIC("Missing file argument.");
 	}
 
-	int *points = NULL;
-	size_t point_count = 0;
-	rectilinearize_file(filename, &points, &point_count);
-
-	int width, height = width = 0;
-	for (size_t i = 0; i < point_count; i+=2) {
-		width  = points[i]   > width  ? points[i]   : width;
-		height = points[i+1] > height ? points[i+1] : height;
-	}
-
-	if (svg_output) {
-		printf(
-			"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
-			"<!-- Created with Inkscape (http://www.inkscape.org/) -->\n"
-			"\n"
-			"<svg\n"
-			"	width=\"%d\"\n"
-			"	height=\"%d\"\n"
-			"	viewBox=\"0 0 %d %d\"\n"
-			"	version=\"1.1\"\n"
-			"	id=\"svg5\"\n"
-			"	inkscape:version=\"1.2.2 (b0a8486541, 2022-12-01)\"\n"
-			"	sodipodi:docname=\"drawing.svg\"\n"
-			"	xmlns:inkscape=\"http://www.inkscape.org/namespaces/inkscape\"\n"
-			"	xmlns:sodipodi=\"http://sodipodi.sourceforge.net/DTD/sodipodi-0.dtd\"\n"
-			"	xmlns=\"http://www.w3.org/2000/svg\"\n"
-			"	xmlns:svg=\"http://www.w3.org/2000/svg\">\n"
-			"	<sodipodi:namedview\n"
-			"		id=\"namedview7\"\n"
-			"		pagecolor=\"#ffffff\"\n"
-			"		bordercolor=\"#000000\"\n"
-			"		borderopacity=\"0.25\"\n"
-			"		inkscape:showpageshadow=\"2\"\n"
-			"		inkscape:pageopacity=\"0.0\"\n"
-			"		inkscape:pagecheckerboard=\"0\"\n"
-			"		inkscape:deskcolor=\"#d1d1d1\"\n"
-			"		inkscape:document-units=\"mm\"\n"
-			"		showgrid=\"false\"\n"
-			"		inkscape:zoom=\"0.77593294\"\n"
-			"		inkscape:cx=\"396.94152\"\n"
-			"		inkscape:cy=\"561.90423\"\n"
-			"		inkscape:window-width=\"1916\"\n"
-			"		inkscape:window-height=\"1049\"\n"
-			"		inkscape:window-x=\"1920\"\n"
-			"		inkscape:window-y=\"27\"\n"
-			"		inkscape:window-maximized=\"1\"\n"
-			"		inkscape:current-layer=\"layer1\" />\n"
-			"	<defs\n"
-			"		id=\"defs2\" />\n"
-			"	<g\n"
-			"		inkscape:label=\"Layer 1\"\n"
-			"		inkscape:groupmode=\"layer\"\n"
-			"		id=\"layer1\" />\n"
-			"\n"
-			"	<g\n"
-			"		stroke=\"black\"\n"
-			"		stroke-width=\"1px\">\n", width, height, width, height
-		);
-
-		for (size_t i = 0; i < point_count - 2; i+=2) {
-			printf("		<line x1=\"%dpx\" y1=\"%dpx\" x2=\"%dpx\" y2=\"%dpx\"/>\n",
-					points[i], points[i+1], points[i+2], points[i+3]);
-		}
-
-		printf(
-			"	</g>\n"
-			"</svg>\n"
-		 );
-	} else {
-		printf("[\n");
-		for (size_t i = 0; i < point_count - 2; i+=2) {
-			printf("\t{ \"x\": %d, \"y\": %d },\n", points[i], points[i+1]);
+	if (output.dedup != NULL && output.output_dir != NULL) {
+		PANIC("--dedup writes a single document to stdout and can not be combined with --output-dir.");
+	}
+
+	if (output.dedup != NULL && output.format != FORMAT_JSON) {
+		PANIC("--dedup always writes JSON and can not be combined with another --format.");
+	}
+
+	// Unlabeled documents written one after another could not be told apart or even parsed
+	if (output.dedup == NULL && !output_format_is_labeled(output.format)) {
+		if (options.cell_width > 0) {
+			PANIC("--atlas writes several polygons per image, use --format ndjson or geojson.");
+		}
+		if (output.output_dir == NULL && inputs.count > 1) {
+			PANIC("%zu inputs can only be written to stdout with --format ndjson or geojson, or use --output-dir.", inputs.count);
 		}
-		printf("\t{ \"x\": %d, \"y\": %d }\n", points[point_count - 2], points[point_count - 1]);
-		printf("]\n");
 	}
+
+	if (output.output_dir != NULL) {
+		check_unique_outputs(&output);
+	}
+
+	if (output.output_dir != NULL && !PATH_EXISTS(output.output_dir)) {
+		path_mkdirs(CSTR_ARRAY_MAKE(output.output_dir));
+	}
+
+	if (output.output_dir != NULL && !force) {
+		inputs = drop_up_to_date(inputs, &output);
+		if (inputs.count == 0) {
+			return !trace_close();
+		}
+	}
+
+	options.threads = threads;
+	writer_init_fd(&output.writer, STDOUT_FILENO, WRITER_DEFAULT_CAPACITY);
+
+	// Records must never be split across writes, or lines from concurrent writers could interleave
+	output.writer.grow = output.format == FORMAT_NDJSON;
+	pipeline_run(inputs, options, write_item, &output);
+	if (output.dedup != NULL) {
+		dedup_write(output.dedup, &output.writer);
+		dedup_free(output.dedup);
+	}
+	if (!writer_flush(&output.writer)) {
+		output.failed += 1;
+	}
+	writer_free(&output.writer);
+
+	if (output.print_stats) {
+		print_stats(&output.stats, output.stats_count);
+	}
+	if (!trace_close()) {
+		output.failed += 1;
+	}
+
+	return output.failed > 0;
 }
 #endif //BINARY
@@ -2,6 +2,25 @@
 #define RECTILIEARIZE_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The library is built with -fvisibility=hidden, only the functions declared here are exported from the shared library.
+// The single header build/rectilinearize.h makes them static instead when RECTILINEARIZE_STATIC is defined
+#if defined(RECTILINEARIZE_STATIC) && (defined(__GNUC__) || defined(__clang__))
+#	define RECTILINEARIZE_API static __attribute__((unused))
+#elif defined(RECTILINEARIZE_STATIC)
+#	define RECTILINEARIZE_API static
+#elif defined(__GNUC__) || defined(__clang__)
+#	define RECTILINEARIZE_API __attribute__((visibility("default")))
+#else
+#	define RECTILINEARIZE_API
+#endif
+
+// librectilinearize.a and librectilinearize.so contain the extractor together with the stb_image, stb_ds and nobuild
+// code it uses, so programs link the library and -lm and nothing else. The stb_ds inside them is renamed and allocates
+// through the allocator of `rectilinearize_set_allocator`, so it never mixes with another stb_ds of the program. A
+// program that compiles its own stb_image into itself has the static library decode with that copy instead.
 
 /**
  * @brief Converts an image represented by an array of RGBA values to rectilinear polygon.
@@ -20,7 +39,24 @@
  *       unsigned char values: red, green, blue, and alpha channels.
  * @note The 'points' array is an even length array where every two elements is a pair of X-Y coordinates.
  */
-void rectilinearize_image(unsigned char *data, int width, int height, int **points, size_t *point_count);
+RECTILINEARIZE_API void rectilinearize_image(unsigned char *data, int width, int height, int **points, size_t *point_count);
+
+/**
+ * @brief Converts a rectangular region of a larger RGBA image to a rectilinear polygon.
+ *
+ * Works like `rectilinearize_image` on the 'width' x 'height' pixels starting at 'data', where consecutive rows are
+ * 'stride' pixels apart. This allows extracting e.g. a single cell of a sprite atlas without copying it.
+ *
+ * @param data A pointer to the top left pixel of the region.
+ * @param width The width of the region.
+ * @param height The height of the region.
+ * @param stride The width of the whole image, i.e. the number of pixels between the start of two rows.
+ * @param points A pointer to an array of XY values relative to the region. This array will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the length of the points array.
+ *
+ * @note The result cache is only used when 'stride' equals 'width'.
+ */
+RECTILINEARIZE_API void rectilinearize_image_view(unsigned char *data, int width, int height, int stride, int **points, size_t *point_count);
 
 /**
  * @brief Converts an image represented by an array of RGBA values to rectilinear polygon.
@@ -36,6 +72,308 @@ void rectilinearize_image(unsigned char *data, int width, int height, int **poin
  * @note The 'filename' string must point to a valid png file with an alpha channel
  * @note The 'points' array is an even length array where every two elements is a pair of X-Y coordinates.
  */
-void rectilinearize_file(const char *filename, int **points, size_t *point_count);
+RECTILINEARIZE_API void rectilinearize_file(const char *filename, int **points, size_t *point_count);
+
+/**
+ * @brief Where the time of an extraction went.
+ *
+ * Filled by `rectilinearize_image_stats` and `rectilinearize_file_stats`. Every field is added to, so the same struct
+ * can collect the totals of many extractions. Timings are measured with a monotonic clock. When the library is built
+ * with RECTILINEARIZE_NO_STATS the instrumentation is compiled out and the struct is left untouched.
+ */
+typedef struct {
+	uint64_t decode_ns;       // Decoding the png, only measured by `rectilinearize_file_stats`
+	uint64_t scan_ns;         // Scanning the pixels for corners
+	uint64_t sort_y_ns;       // Sorting the corners by row
+	uint64_t sort_x_ns;       // Sorting the corners by column
+	uint64_t edges_ns;        // Building the hash maps of horizontal and vertical edges
+	uint64_t walk_ns;         // Walking the edges to put the vertices in order
+
+	uint64_t pixels;          // Pixels scanned
+	uint64_t corners;         // Corners found
+	uint64_t edges;           // Horizontal and vertical edges
+	uint64_t hash_probes;     // Insertions into and lookups in the edge hash maps
+	uint64_t bytes_allocated; // Bytes allocated for the corner, edge and vertex arrays
+	uint64_t allocations;     // Calls to the allocator of `rectilinearize_set_allocator` by the extracting thread
+	uint64_t peak_bytes;      // Largest amount of memory held at once through that allocator, kept as a maximum
+} RectilinearizeStats;
+
+/**
+ * @brief Works like `rectilinearize_image` and adds the timings and counters of the extraction to 'stats'.
+ *
+ * @note The result cache is never used, so the numbers always describe a full extraction.
+ */
+RECTILINEARIZE_API void rectilinearize_image_stats(unsigned char *data, int width, int height, int **points, size_t *point_count, RectilinearizeStats *stats);
+
+/**
+ * @brief Works like `rectilinearize_file` and adds the timings and counters of decoding and extraction to 'stats'.
+ *
+ * @note The result cache is never used, so the numbers always describe a full extraction.
+ */
+RECTILINEARIZE_API void rectilinearize_file_stats(const char *filename, int **points, size_t *point_count, RectilinearizeStats *stats);
+
+/**
+ * @brief The stages reported to a `RectilinearizeStageHook`, in the order they run.
+ */
+typedef enum {
+	RECTILINEARIZE_STAGE_NONE,   // Outside of any stage, reported once an extraction finished
+	RECTILINEARIZE_STAGE_DECODE,
+	RECTILINEARIZE_STAGE_SCAN,
+	RECTILINEARIZE_STAGE_SORT_Y,
+	RECTILINEARIZE_STAGE_SORT_X,
+	RECTILINEARIZE_STAGE_EDGES,  // Reported twice per extraction, once for each axis
+	RECTILINEARIZE_STAGE_WALK,
+	RECTILINEARIZE_STAGE_COUNT,
+} RectilinearizeStage;
+
+typedef void (*RectilinearizeStageHook)(RectilinearizeStage stage, void *user);
+
+/**
+ * @brief Sets a function called whenever `rectilinearize_image_stats` or `rectilinearize_file_stats` enters a stage.
+ *
+ * Everything that happened between two calls belongs to the stage of the first one, which lets a caller attribute its
+ * own measurements, such as hardware performance counters, to the stages. The hook runs on the extracting thread
+ * between two readings of the clock, so its own cost ends up in the timings of `RectilinearizeStats`.
+ *
+ * @param hook The function to call, or NULL to remove the hook.
+ * @param user Passed on to every call of 'hook'.
+ *
+ * @note Not thread-safe, has to be called while no extraction is running.
+ */
+RECTILINEARIZE_API void rectilinearize_set_stage_hook(RectilinearizeStageHook hook, void *user);
+
+/**
+ * @brief The functions every allocation of the vendored stb_ds and stb_image goes through.
+ *
+ * 'realloc' has the semantics of the C function of the same name and is called with a NULL 'ptr' to allocate a new
+ * block. 'free' is never called with NULL.
+ */
+typedef struct {
+	void *(*realloc)(void *user, void *ptr, size_t size);
+	void (*free)(void *user, void *ptr);
+	void *user;
+} RectilinearizeAllocator;
+
+/**
+ * @brief Replaces the allocator used for decoded images, corner arrays and edge maps.
+ *
+ * The library keeps its allocation counters on top of any allocator, so they are always available through
+ * `rectilinearize_alloc_stats`. Memory the library hands to the caller, such as the vertex arrays, is still allocated
+ * with `malloc` and has to be freed with `free`.
+ *
+ * @param allocator The allocator to copy, or NULL to go back to `realloc` and `free`.
+ *
+ * @note Not thread-safe, has to be called before any other function of the library is used.
+ */
+RECTILINEARIZE_API void rectilinearize_set_allocator(const RectilinearizeAllocator *allocator);
+
+/**
+ * @brief Totals of every allocation made by the library since it was loaded or since `rectilinearize_alloc_stats_reset`.
+ */
+typedef struct {
+	uint64_t allocations;       // Blocks allocated
+	uint64_t reallocations;     // Blocks resized
+	uint64_t frees;             // Blocks freed
+	uint64_t bytes_allocated;   // Bytes requested by allocations and by growing reallocations
+	uint64_t bytes_in_use;      // Bytes allocated and not freed yet, memory that leaked stays in here
+	uint64_t peak_bytes_in_use; // Largest value 'bytes_in_use' reached
+} RectilinearizeAllocStats;
+
+/**
+ * @brief Reads the allocation counters of the library, which are shared by every thread.
+ */
+RECTILINEARIZE_API void rectilinearize_alloc_stats(RectilinearizeAllocStats *stats);
+
+/**
+ * @brief Sets every counter back to zero and the peak to the bytes currently in use.
+ */
+RECTILINEARIZE_API void rectilinearize_alloc_stats_reset(void);
+
+/**
+ * @brief A polygon that can be updated after parts of its image changed, see `rectilinearize_result_create`.
+ */
+typedef struct RectilinearizeResult RectilinearizeResult;
+
+/**
+ * @brief Extracts the polygon of an RGBA image and keeps what is needed to update it incrementally.
+ *
+ * Works like `rectilinearize_image`, but also keeps the corner pixels of the image and the edges between them, so
+ * `rectilinearize_result_update` only has to rescan the pixels that changed instead of the whole image.
+ *
+ * @param data A pointer to an array of RGBA values representing the image.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ *
+ * @return A handle that has to be freed with `rectilinearize_result_free`, or NULL if it could not be allocated.
+ */
+RECTILINEARIZE_API RectilinearizeResult *rectilinearize_result_create(unsigned char *data, int width, int height);
+
+/**
+ * @brief Updates the polygon after the pixels in a rectangle of the image changed.
+ *
+ * Only the changed rectangle plus a one pixel border is scanned again. The corners found there replace the old ones,
+ * and only the edges of the rows and columns that were scanned are paired up again. The polygon is then walked again
+ * from its first corner, so an update still costs a walk over every vertex of the polygon.
+ *
+ * @param result A handle returned by `rectilinearize_result_create`.
+ * @param data A pointer to the RGBA values of the whole image after the change, the same size as when 'result' was
+ *             created.
+ * @param x The left edge of the changed rectangle.
+ * @param y The top edge of the changed rectangle.
+ * @param width The width of the changed rectangle.
+ * @param height The height of the changed rectangle.
+ */
+RECTILINEARIZE_API void rectilinearize_result_update(RectilinearizeResult *result, unsigned char *data, int x, int y, int width, int height);
+
+/**
+ * @brief Returns the current polygon of 'result'.
+ *
+ * @param result A handle returned by `rectilinearize_result_create`.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices.
+ *
+ * @return An array of XY values owned by 'result'. It stays valid until the next update of 'result'.
+ */
+RECTILINEARIZE_API const int *rectilinearize_result_points(const RectilinearizeResult *result, size_t *point_count);
+
+RECTILINEARIZE_API void rectilinearize_result_free(RectilinearizeResult *result);
+
+/**
+ * @brief Enables the on-disk result cache.
+ *
+ * Once enabled, `rectilinearize_image` looks up every result under a hash of the decoded pixels and
+ * `rectilinearize_file` first under a hash of the raw file bytes, so an input that was seen before is neither decoded
+ * nor scanned again. Every entry is a single file in the binary polygon format, named after its key.
+ *
+ * @param dir Path to an existing directory holding the cache entries, or NULL to disable the cache.
+ *
+ * @note Not thread-safe, has to be called before any other function of the library is used.
+ * @note The cache is only available on POSIX systems. On Windows this does nothing, and loading from or storing into
+ *       the cache never finds or writes anything.
+ */
+RECTILINEARIZE_API void rectilinearize_set_cache_dir(const char *dir);
+
+/**
+ * @brief Computes the cache key of a png file from its raw contents.
+ *
+ * @param data A pointer to the contents of the file.
+ * @param size The size of 'data' in bytes.
+ */
+RECTILINEARIZE_API uint64_t rectilinearize_cache_key(const unsigned char *data, size_t size);
+
+/**
+ * @brief Looks up the polygon stored under 'key' in the result cache.
+ *
+ * @param key A key returned by `rectilinearize_cache_key`.
+ * @param points A pointer to an array of XY values that will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices in 'points'.
+ * @param width If not NULL, set to the width of the source image.
+ * @param height If not NULL, set to the height of the source image.
+ *
+ * @return false if the cache is disabled or has no valid entry for 'key'.
+ */
+RECTILINEARIZE_API bool rectilinearize_cache_load(uint64_t key, int **points, size_t *point_count, int *width, int *height);
+
+/**
+ * @brief Stores a polygon under 'key' in the result cache. Does nothing if the cache is disabled.
+ *
+ * @note Entries are written to a temporary file and renamed into place, so several processes can share a cache
+ *       directory.
+ */
+RECTILINEARIZE_API void rectilinearize_cache_store(uint64_t key, const int *points, size_t point_count, int width, int height);
+
+#define RECTILINEARIZE_BIN_MAGIC   "RPLY"
+#define RECTILINEARIZE_BIN_VERSION 1
+
+// Set in `RectilinearizeBinHeader.flags` when the coordinates are stored as uint16 instead of int32
+#define RECTILINEARIZE_BIN_U16 (1 << 0)
+
+/**
+ * @brief Header of the binary polygon format.
+ *
+ * The file is laid out as the header, followed by `uint32_t ring_sizes[ring_count]` holding the number of vertices of
+ * every ring, followed by the XY pairs of all the rings back to back. Every field is little-endian and every section
+ * is 4 byte aligned, so on little-endian machines a `mmap`ed file can be used in place:
+ *
+ *     const RectilinearizeBinHeader *header = map;
+ *     const uint32_t *ring_sizes = (const uint32_t *) (header + 1);
+ *     const int32_t *coords = (const int32_t *) (ring_sizes + header->ring_count); // uint16_t with RECTILINEARIZE_BIN_U16
+ */
+typedef struct {
+	char magic[4];       // RECTILINEARIZE_BIN_MAGIC
+	uint16_t version;    // RECTILINEARIZE_BIN_VERSION
+	uint16_t flags;      // RECTILINEARIZE_BIN_* flags
+	uint32_t width;      // Width of the source image
+	uint32_t height;     // Height of the source image
+	uint32_t ring_count; // Number of rings in the polygon
+} RectilinearizeBinHeader;
+
+/**
+ * @brief Encodes a polygon in the binary polygon format.
+ *
+ * @param points An array of XY values as returned by `rectilinearize_image`.
+ * @param point_count The number of vertices in 'points'.
+ * @param width The width of the source image.
+ * @param height The height of the source image.
+ * @param out Buffer the encoded polygon is written to, or NULL to only compute the size.
+ *
+ * @return The size of the encoded polygon in bytes.
+ *
+ * @note Coordinates are stored as uint16 whenever the image is small enough.
+ */
+RECTILINEARIZE_API size_t rectilinearize_bin_encode(const int *points, size_t point_count, int width, int height, unsigned char *out);
+
+/**
+ * @brief Decodes a polygon stored in the binary polygon format.
+ *
+ * @param data A pointer to the encoded polygon.
+ * @param size The size of 'data' in bytes.
+ * @param points A pointer to an array of XY values that will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices in 'points'.
+ * @param width If not NULL, set to the width of the source image.
+ * @param height If not NULL, set to the height of the source image.
+ *
+ * @return false if 'data' is not a valid binary polygon.
+ */
+RECTILINEARIZE_API bool rectilinearize_bin_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height);
+
+#define RECTILINEARIZE_VARINT_MAGIC   "RPLV"
+#define RECTILINEARIZE_VARINT_VERSION 1
+
+/**
+ * @brief Encodes a polygon as a delta + varint stream.
+ *
+ * Every edge of a rectilinear polygon moves along a single axis and consecutive edges alternate between the axes, so
+ * after the first vertex each vertex only costs one zigzag encoded LEB128 varint holding the delta along the axis
+ * that changed. The stream is laid out as the magic RECTILINEARIZE_VARINT_MAGIC followed by varints:
+ *
+ *     version, width, height, ring_count,
+ *     for every ring: (vertex_count << 1 | first edge is vertical), x, y, delta[vertex_count - 1]
+ *
+ * The closing edge of every ring is implied.
+ *
+ * @param points An array of XY values as returned by `rectilinearize_image`.
+ * @param point_count The number of vertices in 'points'.
+ * @param width The width of the source image.
+ * @param height The height of the source image.
+ * @param out Buffer the encoded polygon is written to, or NULL to only compute the size.
+ *
+ * @return The size of the encoded polygon in bytes, or 0 if the edges of the polygon do not alternate between the
+ *         axes.
+ */
+RECTILINEARIZE_API size_t rectilinearize_varint_encode(const int *points, size_t point_count, int width, int height, unsigned char *out);
+
+/**
+ * @brief Decodes a polygon stored as a delta + varint stream.
+ *
+ * @param data A pointer to the encoded polygon.
+ * @param size The size of 'data' in bytes.
+ * @param points A pointer to an array of XY values that will be allocated by the function.
+ * @param point_count A pointer to a size_t variable that will be set to the number of vertices in 'points'.
+ * @param width If not NULL, set to the width of the source image.
+ * @param height If not NULL, set to the height of the source image.
+ *
+ * @return false if 'data' is not a valid delta + varint stream.
+ */
+RECTILINEARIZE_API bool rectilinearize_varint_decode(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height);
 
 #endif  // RECTILIEARIZE_H_
@@ -0,0 +1,350 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "main.h"
+#include "output.h"
+
+static const char *format_names[] = {
+	[FORMAT_JSON]        = "json",
+	[FORMAT_SVG]         = "svg",
+	[FORMAT_BIN]         = "bin",
+	[FORMAT_VARINT]      = "varint",
+	[FORMAT_SVG_COMPACT] = "svg-compact",
+	[FORMAT_NDJSON]      = "ndjson",
+	[FORMAT_GEOJSON]     = "geojson",
+	[FORMAT_WKB]         = "wkb",
+};
+
+bool output_format_parse(const char *name, Output_Format *format) {
+	for (size_t i = 0; i < sizeof format_names / sizeof *format_names; ++i) {
+		if (strcmp(name, format_names[i]) == 0) {
+			*format = (Output_Format) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *output_format_extension(Output_Format format) {
+	switch (format) {
+		case FORMAT_JSON:        return ".json";
+		case FORMAT_SVG:         return ".svg";
+		case FORMAT_BIN:         return ".bin";
+		case FORMAT_VARINT:      return ".rpv";
+		// Kept apart from svg, or the outputs of one format would count as up to date for the other
+		case FORMAT_SVG_COMPACT: return ".c.svg";
+		case FORMAT_NDJSON:      return ".ndjson";
+		case FORMAT_GEOJSON:     return ".geojson";
+		case FORMAT_WKB:         return ".wkb";
+	}
+	return "";
+}
+
+bool output_format_is_labeled(Output_Format format) {
+	return format == FORMAT_NDJSON || format == FORMAT_GEOJSON;
+}
+
+bool write_polygon(Writer *out, Output_Format format, const char *path, const int *points, size_t point_count, int width, int height) {
+	switch (format) {
+		case FORMAT_JSON:
+			write_json(out, points, point_count);
+			break;
+		case FORMAT_SVG:
+			write_svg(out, points, point_count, width, height);
+			break;
+		case FORMAT_BIN:
+			write_bin(out, points, point_count, width, height);
+			break;
+		case FORMAT_VARINT:
+			return write_varint(out, points, point_count, width, height);
+		case FORMAT_SVG_COMPACT:
+			write_svg_compact(out, points, point_count, width, height);
+			break;
+		case FORMAT_NDJSON:
+			write_ndjson(out, path, points, point_count);
+			break;
+		case FORMAT_GEOJSON:
+			write_geojson(out, path, points, point_count);
+			break;
+		case FORMAT_WKB:
+			write_wkb(out, points, point_count);
+			break;
+	}
+	return true;
+}
+
+void write_svg(Writer *out, const int *points, size_t point_count, int width, int height) {
+	writer_put_str(out,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+		"<!-- Created with Inkscape (http://www.inkscape.org/) -->\n"
+		"\n"
+		"<svg\n"
+		"	width=\""
+	);
+	writer_put_int(out, width);
+	writer_put_str(out, "\"\n	height=\"");
+	writer_put_int(out, height);
+	writer_put_str(out, "\"\n	viewBox=\"0 0 ");
+	writer_put_int(out, width);
+	writer_put_char(out, ' ');
+	writer_put_int(out, height);
+	writer_put_str(out,
+		"\"\n"
+		"	version=\"1.1\"\n"
+		"	id=\"svg5\"\n"
+		"	inkscape:version=\"1.2.2 (b0a8486541, 2022-12-01)\"\n"
+		"	sodipodi:docname=\"drawing.svg\"\n"
+		"	xmlns:inkscape=\"http://www.inkscape.org/namespaces/inkscape\"\n"
+		"	xmlns:sodipodi=\"http://sodipodi.sourceforge.net/DTD/sodipodi-0.dtd\"\n"
+		"	xmlns=\"http://www.w3.org/2000/svg\"\n"
+		"	xmlns:svg=\"http://www.w3.org/2000/svg\">\n"
+		"	<sodipodi:namedview\n"
+		"		id=\"namedview7\"\n"
+		"		pagecolor=\"#ffffff\"\n"
+		"		bordercolor=\"#000000\"\n"
+		"		borderopacity=\"0.25\"\n"
+		"		inkscape:showpageshadow=\"2\"\n"
+		"		inkscape:pageopacity=\"0.0\"\n"
+		"		inkscape:pagecheckerboard=\"0\"\n"
+		"		inkscape:deskcolor=\"#d1d1d1\"\n"
+		"		inkscape:document-units=\"mm\"\n"
+		"		showgrid=\"false\"\n"
+		"		inkscape:zoom=\"0.77593294\"\n"
+		"		inkscape:cx=\"396.94152\"\n"
+		"		inkscape:cy=\"561.90423\"\n"
+		"		inkscape:window-width=\"1916\"\n"
+		"		inkscape:window-height=\"1049\"\n"
+		"		inkscape:window-x=\"1920\"\n"
+		"		inkscape:window-y=\"27\"\n"
+		"		inkscape:window-maximized=\"1\"\n"
+		"		inkscape:current-layer=\"layer1\" />\n"
+		"	<defs\n"
+		"		id=\"defs2\" />\n"
+		"	<g\n"
+		"		inkscape:label=\"Layer 1\"\n"
+		"		inkscape:groupmode=\"layer\"\n"
+		"		id=\"layer1\" />\n"
+		"\n"
+		"	<g\n"
+		"		stroke=\"black\"\n"
+		"		stroke-width=\"1px\">\n"
+	);
+
+	for (size_t i = 0; i < point_count; ++i) {
+		size_t j = (i + 1) % point_count;
+		writer_put_str(out, "\t\t<line x1=\"");
+		writer_put_int(out, points[(i << 1)]);
+		writer_put_str(out, "px\" y1=\"");
+		writer_put_int(out, points[(i << 1) + 1]);
+		writer_put_str(out, "px\" x2=\"");
+		writer_put_int(out, points[(j << 1)]);
+		writer_put_str(out, "px\" y2=\"");
+		writer_put_int(out, points[(j << 1) + 1]);
+		writer_put_str(out, "px\"/>\n");
+	}
+
+	writer_put_str(out,
+		"	</g>\n"
+		"</svg>\n"
+	);
+}
+
+void write_svg_compact(Writer *out, const int *points, size_t point_count, int width, int height) {
+	writer_put_str(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"");
+	writer_put_int(out, width);
+	writer_put_str(out, "\" height=\"");
+	writer_put_int(out, height);
+	writer_put_str(out, "\" viewBox=\"0 0 ");
+	writer_put_int(out, width);
+	writer_put_char(out, ' ');
+	writer_put_int(out, height);
+	writer_put_str(out, "\">\n");
+
+	if (point_count > 0) {
+		writer_put_str(out, "<path fill=\"none\" stroke=\"black\" stroke-width=\"1\" d=\"M");
+		writer_put_int(out, points[0]);
+		writer_put_char(out, ' ');
+		writer_put_int(out, points[1]);
+
+		// Every edge moves along a single axis, so one relative h or v command is enough per vertex
+		for (size_t i = 1; i < point_count; ++i) {
+			int dx = points[(i << 1)] - points[(i << 1) - 2];
+			int dy = points[(i << 1) + 1] - points[(i << 1) - 1];
+			if (dx != 0 && dy != 0) {
+				writer_put_char(out, 'l');
+				writer_put_int(out, dx);
+				writer_put_char(out, ' ');
+				writer_put_int(out, dy);
+			} else if (dx != 0) {
+				writer_put_char(out, 'h');
+				writer_put_int(out, dx);
+			} else {
+				writer_put_char(out, 'v');
+				writer_put_int(out, dy);
+			}
+		}
+		writer_put_str(out, "z\"/>\n");
+	}
+
+	writer_put_str(out, "</svg>\n");
+}
+
+void write_json(Writer *out, const int *points, size_t point_count) {
+	writer_put_str(out, "[\n");
+	for (size_t i = 0; i < point_count; ++i) {
+		writer_put_str(out, "\t{ \"x\": ");
+		writer_put_int(out, points[(i << 1)]);
+		writer_put_str(out, ", \"y\": ");
+		writer_put_int(out, points[(i << 1) + 1]);
+		writer_put_str(out, i + 1 < point_count ? " },\n" : " }\n");
+	}
+	writer_put_str(out, "]\n");
+}
+
+void write_json_string(Writer *out, const char *str) {
+	static const char hex[] = "0123456789abcdef";
+
+	writer_put_char(out, '"');
+	const char *start = str;
+	for (const char *p = str; *p; ++p) {
+		unsigned char c = (unsigned char) *p;
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+
+		writer_put(out, start, (size_t) (p - start));
+		start = p + 1;
+		switch (c) {
+			case '"':  writer_put_str(out, "\\\""); break;
+			case '\\': writer_put_str(out, "\\\\"); break;
+			case '\n': writer_put_str(out, "\\n"); break;
+			case '\t': writer_put_str(out, "\\t"); break;
+			default:
+				writer_put_str(out, "\\u00");
+				writer_put_char(out, hex[c >> 4]);
+				writer_put_char(out, hex[c & 0xf]);
+				break;
+		}
+	}
+	writer_put_str(out, start);
+	writer_put_char(out, '"');
+}
+
+void write_ndjson(Writer *out, const char *path, const int *points, size_t point_count) {
+	writer_put_str(out, "{\"file\":");
+	write_json_string(out, path);
+	writer_put_str(out, point_count > 0 ? ",\"rings\":[[" : ",\"rings\":[");
+	for (size_t i = 0; i < (point_count << 1); ++i) {
+		if (i > 0) {
+			writer_put_char(out, ',');
+		}
+		writer_put_int(out, points[i]);
+	}
+	writer_put_str(out, point_count > 0 ? "]]}\n" : "]}\n");
+}
+
+void write_ndjson_error(Writer *out, const char *path, const char *message) {
+	writer_put_str(out, "{\"file\":");
+	write_json_string(out, path);
+	writer_put_str(out, ",\"error\":");
+	write_json_string(out, message);
+	writer_put_str(out, "}\n");
+}
+
+// Both GeoJSON (RFC 7946) and OGC simple features want the exterior ring to be counterclockwise. The orientation is
+// taken in the coordinates as they are written, i.e. with the y axis pointing up.
+static bool ring_is_ccw(const int *points, size_t point_count) {
+	long long area = 0;
+	for (size_t i = 0; i < point_count; ++i) {
+		size_t j = (i + 1) % point_count;
+		area += (long long) points[(i << 1)] * points[(j << 1) + 1] - (long long) points[(j << 1)] * points[(i << 1) + 1];
+	}
+	return area >= 0;
+}
+
+// Index of the i-th vertex of the ring once it is oriented counterclockwise. Reversed rings still start at vertex 0
+static size_t ccw_index(size_t i, size_t point_count, bool reverse) {
+	return reverse ? (point_count - i) % point_count : i % point_count;
+}
+
+void write_geojson(Writer *out, const char *path, const int *points, size_t point_count) {
+	writer_put_str(out, "{\"type\":\"Feature\",\"properties\":{\"file\":");
+	write_json_string(out, path);
+	writer_put_str(out, "},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[");
+
+	if (point_count > 0) {
+		bool reverse = !ring_is_ccw(points, point_count);
+		writer_put_char(out, '[');
+
+		// The ring is closed by repeating the first vertex
+		for (size_t i = 0; i <= point_count; ++i) {
+			size_t k = ccw_index(i, point_count, reverse);
+			writer_put_str(out, i > 0 ? ",[" : "[");
+			writer_put_int(out, points[(k << 1)]);
+			writer_put_char(out, ',');
+			writer_put_int(out, points[(k << 1) + 1]);
+			writer_put_char(out, ']');
+		}
+		writer_put_char(out, ']');
+	}
+
+	writer_put_str(out, "]}}\n");
+}
+
+static unsigned char *put_wkb_u32(unsigned char *p, uint32_t v) {
+	for (size_t i = 0; i < sizeof v; ++i) {
+		*p++ = (unsigned char) (v >> (i * 8));
+	}
+	return p;
+}
+
+static unsigned char *put_wkb_double(unsigned char *p, double d) {
+	uint64_t v;
+	memcpy(&v, &d, sizeof v);
+	for (size_t i = 0; i < sizeof v; ++i) {
+		*p++ = (unsigned char) (v >> (i * 8));
+	}
+	return p;
+}
+
+void write_wkb(Writer *out, const int *points, size_t point_count) {
+	uint32_t ring_count = point_count > 0 ? 1 : 0;
+	size_t size = 1 + 4 + 4 + ring_count * (4 + (point_count + 1) * 2 * sizeof(double));
+	unsigned char *start = writer_reserve(out, size);
+	unsigned char *p = start;
+
+	*p++ = 1; // Little-endian
+	p = put_wkb_u32(p, 3); // Polygon
+	p = put_wkb_u32(p, ring_count);
+	if (ring_count > 0) {
+		bool reverse = !ring_is_ccw(points, point_count);
+		p = put_wkb_u32(p, (uint32_t) point_count + 1);
+		for (size_t i = 0; i <= point_count; ++i) {
+			size_t k = ccw_index(i, point_count, reverse);
+			p = put_wkb_double(p, points[(k << 1)]);
+			p = put_wkb_double(p, points[(k << 1) + 1]);
+		}
+	}
+
+	writer_commit(out, (size_t) (p - start));
+}
+
+void write_bin(Writer *out, const int *points, size_t point_count, int width, int height) {
+	size_t size = rectilinearize_bin_encode(points, point_count, width, height, NULL);
+	rectilinearize_bin_encode(points, point_count, width, height, writer_reserve(out, size));
+	writer_commit(out, size);
+}
+
+bool write_varint(Writer *out, const int *points, size_t point_count, int width, int height) {
+	size_t size = rectilinearize_varint_encode(points, point_count, width, height, NULL);
+	if (size == 0) {
+		ERRO("Polygon edges do not alternate between horizontal and vertical");
+		return false;
+	}
+
+	rectilinearize_varint_encode(points, point_count, width, height, writer_reserve(out, size));
+	writer_commit(out, size);
+	return true;
+}
@@ -0,0 +1,65 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "writer.h"
+
+typedef enum {
+	FORMAT_JSON = 0,
+	FORMAT_SVG,
+	FORMAT_BIN,
+	FORMAT_VARINT,
+	FORMAT_SVG_COMPACT,
+	FORMAT_NDJSON,
+	FORMAT_GEOJSON,
+	FORMAT_WKB,
+} Output_Format;
+
+// Parses the argument of `--format`. Returns false for unknown formats
+bool output_format_parse(const char *name, Output_Format *format);
+
+// File extension, including the dot, used for the format in `--output-dir`
+const char *output_format_extension(Output_Format format);
+
+// Whether 'format' writes one self-contained line per polygon, labeled with its path, so several polygons can share an
+// output. The other formats write a single unlabeled document per polygon
+bool output_format_is_labeled(Output_Format format);
+
+// Writes the polygon extracted from 'path' in 'format'. Returns false when the polygon can not be encoded in 'format'
+bool write_polygon(Writer *out, Output_Format format, const char *path, const int *points, size_t point_count, int width, int height);
+
+// Writes the polygon as an SVG document with one line per edge
+void write_svg(Writer *out, const int *points, size_t point_count, int width, int height);
+
+// Writes the polygon as a minimal SVG document with a single path of relative h/v commands per ring
+void write_svg_compact(Writer *out, const int *points, size_t point_count, int width, int height);
+
+// Writes the polygon as a JSON array of `{ "x": X, "y": Y }` objects
+void write_json(Writer *out, const int *points, size_t point_count);
+
+// Writes 'str' as a quoted JSON string
+void write_json_string(Writer *out, const char *str);
+
+// Writes the polygon as a single line `{"file":PATH,"rings":[[X,Y,...]]}` record
+void write_ndjson(Writer *out, const char *path, const int *points, size_t point_count);
+
+// Writes a single line `{"file":PATH,"error":MESSAGE}` record
+void write_ndjson_error(Writer *out, const char *path, const char *message);
+
+// Writes the polygon as a single line GeoJSON Feature with a counterclockwise, closed exterior ring. Several of them
+// make up newline-delimited GeoJSON (RFC 8142)
+void write_geojson(Writer *out, const char *path, const int *points, size_t point_count);
+
+// Writes the polygon as little-endian OGC WKB with a counterclockwise, closed exterior ring
+void write_wkb(Writer *out, const int *points, size_t point_count);
+
+// Writes the polygon in the binary polygon format described by `RectilinearizeBinHeader`
+void write_bin(Writer *out, const int *points, size_t point_count, int width, int height);
+
+// Writes the polygon as a delta + varint stream, see `rectilinearize_varint_encode`. Returns false and writes nothing
+// when the edges do not alternate between horizontal and vertical
+bool write_varint(Writer *out, const int *points, size_t point_count, int width, int height);
+
+#endif // OUTPUT_H_
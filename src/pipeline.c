@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stb_image.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "main.h"
+#include "loader.h"
+#include "pipeline.h"
+#include "trace.h"
+
+// Bounded single-producer/single-consumer ring buffer. `head` and `tail` increase monotonically and are only ever
+// written by the consumer and producer respectively, so no locks are needed. They live on separate cache lines to
+// avoid the two threads fighting over the same line.
+typedef struct {
+	_Alignas(64) atomic_size_t head; // Index of the next slot to be read
+	_Alignas(64) atomic_size_t tail; // Index of the next slot to be written
+	Pipeline_Item **slots;
+	size_t mask;
+} Queue;
+
+static void queue_init(Queue *q, size_t depth) {
+	size_t capacity = 1;
+	while (capacity < depth) {
+		capacity <<= 1;
+	}
+
+	q->slots = malloc(sizeof *q->slots * capacity);
+	if (q->slots == NULL) {
+		PANIC("Could not allocate pipeline queue of %zu slots", capacity);
+	}
+	q->mask = capacity - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+// Waiting on a stage is expected to be short, so spin on `sched_yield` first and only start sleeping once the other
+// side has clearly stalled. This keeps the queue lock-free without burning a core on long decodes.
+static void queue_backoff(unsigned *spins) {
+	if (*spins < 64) {
+		*spins += 1;
+		sched_yield();
+		return;
+	}
+
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000 };
+	nanosleep(&ts, NULL);
+}
+
+static void queue_push(Queue *q, Pipeline_Item *item) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned spins = 0;
+	bool stalled = false;
+	while (tail - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask) {
+		if (!stalled) {
+			trace_begin("queue full", NULL);
+			stalled = true;
+		}
+		queue_backoff(&spins);
+	}
+	if (stalled) {
+		trace_end();
+	}
+
+	q->slots[tail & q->mask] = item;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+static Pipeline_Item *queue_pop(Queue *q) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned spins = 0;
+	bool stalled = false;
+	while (atomic_load_explicit(&q->tail, memory_order_acquire) == head) {
+		if (!stalled) {
+			trace_begin("queue empty", NULL);
+			stalled = true;
+		}
+		queue_backoff(&spins);
+	}
+	if (stalled) {
+		trace_end();
+	}
+
+	Pipeline_Item *item = q->slots[head & q->mask];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return item;
+}
+
+typedef struct {
+	Cstr_Array inputs;
+	size_t prefetch;
+	bool use_cache;
+	int cell_width;
+	int cell_height;
+	size_t threads;
+	bool stats;
+	Queue decoded;   // decode -> extract
+	Queue extracted; // extract -> serialize
+} Pipeline;
+
+static bool is_gif(const unsigned char *data, size_t size) {
+	return size >= 6 && (memcmp(data, "GIF87a", 6) == 0 || memcmp(data, "GIF89a", 6) == 0);
+}
+
+static void decode_image(Pipeline_Item *item, const unsigned char *data, int size) {
+	int channels = 0;
+	if (is_gif(data, (size_t) size)) {
+		// Every frame of an animated gif is decoded at once, stacked on top of each other
+		int *delays = NULL;
+		item->data = stbi_load_gif_from_memory(data, size, &delays, &item->width, &item->height, &item->frame_count, &channels, 4);
+		stbi_image_free(delays);
+		if (item->data != NULL && item->height > INT_MAX / item->frame_count) {
+			stbi_image_free(item->data);
+			item->data = NULL;
+			item->failed = true;
+			return;
+		}
+		if (item->data != NULL) {
+			item->height *= item->frame_count;
+		}
+	} else {
+		item->data = stbi_load_from_memory(data, size, &item->width, &item->height, &channels, 4);
+	}
+
+	if (item->data == NULL || channels != 4) {
+		stbi_image_free(item->data);
+		item->data = NULL;
+		item->failed = true;
+	}
+}
+
+static void *decode_stage(void *arg) {
+	Pipeline *p = arg;
+	trace_thread_name("decode");
+	Loader *loader = loader_open(p->inputs, p->prefetch);
+
+	Loader_File file;
+	while (true) {
+		trace_begin("read", NULL);
+		bool more = loader_next(loader, &file);
+		trace_end();
+		if (!more) {
+			break;
+		}
+
+		Pipeline_Item *item = calloc(1, sizeof *item);
+		if (item == NULL) {
+			PANIC("Could not allocate pipeline item");
+		}
+		item->path = file.path;
+		item->frame_count = 1;
+		item->failed = file.failed || file.size > INT_MAX;
+
+		// A cached entry holds a single polygon for the whole image, so atlases always have to be decoded
+		if (!item->failed && p->use_cache && p->cell_width == 0) {
+			item->cache_key = rectilinearize_cache_key(file.data, file.size);
+			item->cached = rectilinearize_cache_load(item->cache_key, &item->points, &item->point_count, &item->width, &item->height);
+		}
+
+		if (!item->failed && !item->cached) {
+			trace_begin("decode", item->path);
+			struct timespec start, end;
+			if (p->stats) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+			}
+			decode_image(item, file.data, (int) file.size);
+			if (p->stats) {
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				item->stats.decode_ns = (uint64_t) ((end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec));
+			}
+			trace_end();
+		}
+		free(file.data);
+
+		queue_push(&p->decoded, item);
+	}
+	loader_close(loader);
+
+	// A NULL item marks the end of the stream
+	queue_push(&p->decoded, NULL);
+	return NULL;
+}
+
+// Returns whether every pixel of the 'width' x 'height' region at 'data' is fully transparent. The alpha bytes of two
+// pixels are tested at once by OR-ing whole 64-bit words and masking the result once per row.
+static bool is_region_empty(const unsigned char *data, int width, int height, int stride) {
+	static const unsigned char alpha_bytes[8] = { 0, 0, 0, 0xff, 0, 0, 0, 0xff };
+	uint64_t alpha_mask;
+	memcpy(&alpha_mask, alpha_bytes, sizeof alpha_mask);
+
+	for (int y = 0; y < height; ++y) {
+		const unsigned char *row = data + (size_t) y * (size_t) stride * 4;
+		uint64_t acc = 0;
+		int x = 0;
+		for (; x + 2 <= width; x += 2) {
+			uint64_t word;
+			memcpy(&word, row + x * 4, sizeof word);
+			acc |= word;
+		}
+
+		if ((acc & alpha_mask) != 0 || (x < width && row[x * 4 + 3] != 0)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns whether the alpha channels of the 'count' pixels at 'a' and 'b' are identical, comparing two pixels at a time
+static bool is_same_alpha(const unsigned char *a, const unsigned char *b, size_t count) {
+	static const unsigned char alpha_bytes[8] = { 0, 0, 0, 0xff, 0, 0, 0, 0xff };
+	uint64_t alpha_mask;
+	memcpy(&alpha_mask, alpha_bytes, sizeof alpha_mask);
+
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		uint64_t word_a, word_b;
+		memcpy(&word_a, a + i * 4, sizeof word_a);
+		memcpy(&word_b, b + i * 4, sizeof word_b);
+		if (((word_a ^ word_b) & alpha_mask) != 0) {
+			return false;
+		}
+	}
+	return i == count || a[i * 4 + 3] == b[i * 4 + 3];
+}
+
+typedef struct {
+	Pipeline_Item *item;
+	int cell_width;
+	int cell_height;
+	size_t columns;
+	bool *same_as_previous; // Cells whose alpha channel matches the previous cell and reuse its polygon, NULL to never reuse
+	atomic_size_t next;     // Index of the next cell to be claimed by a worker
+} Atlas_Job;
+
+static void *atlas_worker(void *arg) {
+	Atlas_Job *job = arg;
+	Pipeline_Item *item = job->item;
+
+	size_t i;
+	while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < item->cell_count) {
+		int x = (int) (i % job->columns) * job->cell_width;
+		int y = (int) (i / job->columns) * job->cell_height;
+
+		Pipeline_Cell *cell = &item->cells[i];
+		cell->width = item->width - x < job->cell_width ? item->width - x : job->cell_width;
+		cell->height = item->height - y < job->cell_height ? item->height - y : job->cell_height;
+
+		unsigned char *origin = item->data + ((size_t) y * (size_t) item->width + (size_t) x) * 4;
+
+		// Only used for frames, which are whole rows of the image, so the previous cell directly precedes this one
+		size_t pixels = (size_t) cell->width * (size_t) cell->height;
+		if (job->same_as_previous != NULL && i > 0 && is_same_alpha(origin - pixels * 4, origin, pixels)) {
+			job->same_as_previous[i] = true;
+			continue;
+		}
+
+		if (!is_region_empty(origin, cell->width, cell->height, item->width)) {
+			trace_begin("cell", item->path);
+			rectilinearize_image_view(origin, cell->width, cell->height, item->width, &cell->points, &cell->point_count);
+			trace_end();
+		}
+	}
+
+	return NULL;
+}
+
+static void *atlas_helper(void *arg) {
+	trace_thread_name("cell worker");
+	return atlas_worker(arg);
+}
+
+// Extracts every 'cell_width' x 'cell_height' cell of the image on its own. The cells are handed out one at a time to
+// 'threads' workers, one of them being the calling thread, so a few dense cells do not hold up the rest. Extractions
+// only share the seed of new stb_ds hash maps, which the library guards with `hmput_locked`.
+static void extract_cells(Pipeline *p, Pipeline_Item *item, int cell_width, int cell_height, bool reuse) {
+	size_t columns = ((size_t) item->width + (size_t) cell_width - 1) / (size_t) cell_width;
+	size_t rows = ((size_t) item->height + (size_t) cell_height - 1) / (size_t) cell_height;
+	item->cell_count = columns * rows;
+	item->cells = calloc(item->cell_count > 0 ? item->cell_count : 1, sizeof *item->cells);
+	if (item->cells == NULL) {
+		PANIC("Could not allocate %zu cells", item->cell_count);
+	}
+
+	Atlas_Job job = { .item = item, .cell_width = cell_width, .cell_height = cell_height, .columns = columns };
+	atomic_init(&job.next, 0);
+	if (reuse) {
+		job.same_as_previous = calloc(item->cell_count > 0 ? item->cell_count : 1, sizeof *job.same_as_previous);
+		if (job.same_as_previous == NULL) {
+			PANIC("Could not allocate %zu cells", item->cell_count);
+		}
+	}
+
+	size_t helpers = (p->threads < item->cell_count ? p->threads : item->cell_count);
+	helpers = helpers > 0 ? helpers - 1 : 0;
+	pthread_t *workers = malloc(sizeof *workers * (helpers > 0 ? helpers : 1));
+	if (workers == NULL) {
+		PANIC("Could not allocate %zu workers", helpers);
+	}
+
+	size_t started = 0;
+	for (; started < helpers; ++started) {
+		if (pthread_create(&workers[started], NULL, atlas_helper, &job) != 0) {
+			break;
+		}
+	}
+	atlas_worker(&job);
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	// Copies are resolved in order, so a run of identical cells all copy the first one of the run
+	for (size_t i = 1; reuse && i < item->cell_count; ++i) {
+		if (!job.same_as_previous[i]) {
+			continue;
+		}
+
+		Pipeline_Cell *cell = &item->cells[i];
+		const Pipeline_Cell *previous = &item->cells[i - 1];
+		cell->point_count = previous->point_count;
+		if (previous->points != NULL) {
+			cell->points = malloc(sizeof *cell->points * (previous->point_count << 1));
+			if (cell->points == NULL) {
+				PANIC("Could not allocate %zu vertices", previous->point_count);
+			}
+			memcpy(cell->points, previous->points, sizeof *cell->points * (previous->point_count << 1));
+		}
+	}
+	free(job.same_as_previous);
+}
+
+static void *extract_stage(void *arg) {
+	Pipeline *p = arg;
+	trace_thread_name("extract");
+	Pipeline_Item *item;
+	while ((item = queue_pop(&p->decoded)) != NULL) {
+		trace_begin("extract", item->path);
+		if (!item->failed && p->cell_width > 0) {
+			extract_cells(p, item, p->cell_width, p->cell_height, false);
+			stbi_image_free(item->data);
+			item->data = NULL;
+		} else if (!item->failed && item->frame_count > 1) {
+			extract_cells(p, item, item->width, item->height / item->frame_count, true);
+			stbi_image_free(item->data);
+			item->data = NULL;
+		} else if (!item->failed && !item->cached) {
+			// Skips the pixel cache of `rectilinearize_image`, the result is only stored under the key of the file below
+			RectilinearizeStats *stats = p->stats ? &item->stats : NULL;
+			rectilinearize_image_stats(item->data, item->width, item->height, &item->points, &item->point_count, stats);
+			stbi_image_free(item->data);
+			item->data = NULL;
+
+			if (p->use_cache) {
+				rectilinearize_cache_store(item->cache_key, item->points, item->point_count, item->width, item->height);
+			}
+		}
+		trace_end();
+
+		queue_push(&p->extracted, item);
+	}
+
+	queue_push(&p->extracted, NULL);
+	return NULL;
+}
+
+void pipeline_run(Cstr_Array inputs, Pipeline_Options options, Pipeline_Sink sink, void *user) {
+	Pipeline p = {
+		.inputs = inputs, .prefetch = options.prefetch, .use_cache = options.use_cache,
+		.cell_width = options.cell_width, .cell_height = options.cell_height, .threads = options.threads,
+		.stats = options.stats,
+	};
+	if (p.threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		p.threads = cpus > 0 ? (size_t) cpus : 1;
+	}
+	queue_init(&p.decoded, options.queue_depth);
+	queue_init(&p.extracted, options.queue_depth);
+
+	pthread_t decoder, extractor;
+	if (pthread_create(&decoder, NULL, decode_stage, &p) != 0) {
+		PANIC("Could not start the decode stage");
+	}
+	if (pthread_create(&extractor, NULL, extract_stage, &p) != 0) {
+		PANIC("Could not start the extract stage");
+	}
+
+	Pipeline_Item *item;
+	while ((item = queue_pop(&p.extracted)) != NULL) {
+		trace_begin("write", item->path);
+		sink(item, user);
+		trace_end();
+		for (size_t i = 0; i < item->cell_count; ++i) {
+			free(item->cells[i].points);
+		}
+		free(item->cells);
+		free(item->points);
+		free(item);
+	}
+
+	pthread_join(decoder, NULL);
+	pthread_join(extractor, NULL);
+	free(p.decoded.slots);
+	free(p.extracted.slots);
+}
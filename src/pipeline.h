@@ -0,0 +1,64 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <nobuild/nobuild_cstr.h>
+
+#include "main.h"
+
+// Polygon of a single cell of an atlas or frame of an animated image, in coordinates relative to the cell
+typedef struct {
+	int *points;
+	size_t point_count;
+	int width;           // Width of the cell, smaller than the atlas cell size at the right edge of the image
+	int height;          // Height of the cell, smaller than the atlas cell size at the bottom edge of the image
+} Pipeline_Cell;
+
+typedef struct {
+	Cstr path;                 // Path of the input file
+	unsigned char *data;       // Decoded RGBA pixels, NULL once the polygon has been extracted
+	int width;                 // Width of the image
+	int height;                // Height of the image, frames of animated images are stacked on top of each other
+	int frame_count;           // Number of frames of an animated image, 1 otherwise
+	int *points;               // XY pairs of the extracted polygon
+	size_t point_count;        // Number of vertices in 'points'
+	Pipeline_Cell *cells;      // Polygon of every atlas cell in row-major order, or of every frame, instead of 'points'
+	size_t cell_count;         // Number of cells in 'cells'
+	bool failed;               // The file could not be decoded
+	bool cached;               // The polygon was found in the result cache, the file was never decoded
+	uint64_t cache_key;        // Key of the raw file contents in the result cache
+	RectilinearizeStats stats; // Timings and counters of decoding and extraction, only filled with `Pipeline_Options.stats`
+} Pipeline_Item;
+
+typedef struct {
+	size_t queue_depth; // Number of slots in each queue between stages. Rounded up to a power of two
+	size_t prefetch;    // Number of files read ahead of the decode stage
+	bool use_cache;     // Look up files in the result cache before decoding them, see `rectilinearize_set_cache_dir`
+	int cell_width;     // Split every image into a grid of cells of this size and extract every cell on its own, 0 to disable
+	int cell_height;
+	size_t threads;     // Number of threads extracting the cells of an atlas, 0 for the number of CPUs
+	bool stats;         // Fill `Pipeline_Item.stats`
+} Pipeline_Options;
+
+// Called from the thread that invoked `pipeline_run` for every item, in input order.
+typedef void (*Pipeline_Sink)(Pipeline_Item *item, void *user);
+
+/**
+ * @brief Runs the decode -> extract -> serialize pipeline over 'inputs'.
+ *
+ * Decoding and extraction each run on their own thread while serialization happens on the calling thread. The
+ * stages are connected by bounded single-producer/single-consumer queues of 'queue_depth' slots, so at most
+ * `2 * queue_depth + 3` decoded images are alive at any point in time. The raw file contents are read ahead of the
+ * decode stage by a `Loader`.
+ *
+ * @param inputs Paths of the png files to process.
+ * @param options Queue and prefetch sizes.
+ * @param sink Callback that serializes a finished item. The item is freed once the callback returns.
+ * @param user Opaque pointer passed to 'sink'.
+ */
+void pipeline_run(Cstr_Array inputs, Pipeline_Options options, Pipeline_Sink sink, void *user);
+
+#endif // PIPELINE_H_
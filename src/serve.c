@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <stb_image.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "main.h"
+#include "output.h"
+#include "serve.h"
+#include "trace.h"
+
+// Connections with a request waiting to be read, handed from the dispatcher to the workers. The dispatcher stops
+// watching a connection before queueing it, so it is in the queue at most once and only one worker ever reads from it.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int *fds;
+	size_t head;     // Index of the next connection to be answered
+	size_t count;    // Number of queued connections
+	size_t capacity;
+	bool stopping;   // Set once the daemon is asked to stop, the workers exit once the queue is empty
+} Serve_Queue;
+
+typedef struct {
+	int epoll_fd;
+	Serve_Queue queue;
+} Serve;
+
+// Per worker state, allocated once and reused for every request the worker answers
+typedef struct {
+	Serve *serve;
+	int fd;                    // Connection being answered or -1, guarded by the lock of the queue
+	uint64_t deadline_ms;      // The current request has to arrive in full before this point of the monotonic clock
+
+	unsigned char *request;    // Payload of the current request
+	size_t request_capacity;
+
+	Writer response;           // In memory, reset before every response
+} Serve_Context;
+
+static void queue_push(Serve_Queue *q, int fd) {
+	pthread_mutex_lock(&q->lock);
+	if (q->count == q->capacity) {
+		size_t capacity = q->capacity > 0 ? q->capacity << 1 : 64;
+		int *fds = malloc(sizeof *fds * capacity);
+		if (fds == NULL) {
+			PANIC("Could not queue %zu connections", capacity);
+		}
+		for (size_t i = 0; i < q->count; ++i) {
+			fds[i] = q->fds[(q->head + i) % q->capacity];
+		}
+		free(q->fds);
+		q->fds = fds;
+		q->head = 0;
+		q->capacity = capacity;
+	}
+
+	q->fds[(q->head + q->count) % q->capacity] = fd;
+	q->count += 1;
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Returns the next connection with a request waiting and records it in '*busy', or -1 once the daemon is stopping and
+// every queued connection has been handed out. While stopping, only the bytes that already arrived are read from a
+// connection, so a request that is still incomplete fails instead of holding up the shutdown
+static int queue_pop(Serve_Queue *q, int *busy) {
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->stopping) {
+		pthread_cond_wait(&q->ready, &q->lock);
+	}
+	int fd = -1;
+	if (q->count > 0) {
+		fd = q->fds[q->head];
+		q->head = (q->head + 1) % q->capacity;
+		q->count -= 1;
+		if (q->stopping) {
+			shutdown(fd, SHUT_RD);
+		}
+	}
+	*busy = fd;
+	pthread_mutex_unlock(&q->lock);
+	return fd;
+}
+
+// Must happen before the connection is watched again or closed, so `serve` never shuts down a reused descriptor.
+// Returns whether the daemon is stopping, the connection is closed instead of watched again then
+static bool queue_done(Serve_Queue *q, int *busy) {
+	pthread_mutex_lock(&q->lock);
+	*busy = -1;
+	bool stopping = q->stopping;
+	pthread_mutex_unlock(&q->lock);
+	return stopping;
+}
+
+// Makes the dispatcher wait for the next request on 'fd'
+static void watch(int epoll_fd, int fd) {
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		PANIC("Could not watch connection: %s", strerror(errno));
+	}
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000u + (uint64_t) ts.tv_nsec / 1000000u;
+}
+
+// Gives up once 'deadline_ms' passed, so a client that stops sending in the middle of a request, or sends it a byte at
+// a time, can not hold on to a worker
+static bool read_full(int fd, void *buf, size_t count, uint64_t deadline_ms) {
+	unsigned char *p = buf;
+	while (count > 0) {
+		uint64_t now = now_ms();
+		if (now >= deadline_ms) {
+			return false;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int ready = poll(&pfd, 1, (int) (deadline_ms - now));
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			return false;
+		}
+
+		ssize_t n = read(fd, p, count);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		count -= (size_t) n;
+	}
+	return true;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static bool respond(int fd, uint32_t status, const void *payload, size_t length) {
+	unsigned char header[8];
+	put_u32(header, status);
+	put_u32(header + 4, (uint32_t) length);
+
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof header },
+		{ .iov_base = (void *) payload, .iov_len = length },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = length > 0 ? 2 : 1 };
+	size_t remaining = sizeof header + length;
+	while (remaining > 0) {
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+
+		// Short writes are rare on unix sockets but still have to be handled
+		remaining -= (size_t) n;
+		while (n > 0 && msg.msg_iovlen > 0) {
+			size_t step = (size_t) n < msg.msg_iov->iov_len ? (size_t) n : msg.msg_iov->iov_len;
+			msg.msg_iov->iov_base = (unsigned char *) msg.msg_iov->iov_base + step;
+			msg.msg_iov->iov_len -= step;
+			n -= (ssize_t) step;
+			if (msg.msg_iov->iov_len == 0) {
+				msg.msg_iov += 1;
+				msg.msg_iovlen -= 1;
+			}
+		}
+	}
+	return true;
+}
+
+static bool answer_request(Serve_Context *ctx, int fd, const unsigned char *header) {
+	unsigned char kind = header[0];
+	unsigned char format = header[1];
+	size_t length = get_u32(header + 4);
+	if (length > SERVE_MAX_PAYLOAD) {
+		respond(fd, SERVE_STATUS_BAD_REQUEST, NULL, 0);
+		return false;
+	}
+
+	// One extra byte so paths can be NUL terminated in place
+	if (length + 1 > ctx->request_capacity) {
+		free(ctx->request);
+		ctx->request_capacity = length + 1;
+		ctx->request = malloc(ctx->request_capacity);
+		if (ctx->request == NULL) {
+			PANIC("Could not allocate %zu bytes for a request", ctx->request_capacity);
+		}
+	}
+
+	if (!read_full(fd, ctx->request, length, ctx->deadline_ms)) {
+		return false;
+	}
+	ctx->request[length] = '\0';
+
+	if ((kind != SERVE_KIND_PATH && kind != SERVE_KIND_DATA) || (format != SERVE_FORMAT_JSON && format != SERVE_FORMAT_BIN && format != SERVE_FORMAT_VARINT)) {
+		return respond(fd, SERVE_STATUS_BAD_REQUEST, NULL, 0);
+	}
+
+	int width, height, channels = 0;
+	unsigned char *data = NULL;
+	trace_begin("decode", NULL);
+	if (kind == SERVE_KIND_PATH) {
+		data = stbi_load((const char *) ctx->request, &width, &height, &channels, 4);
+	} else if (length <= INT32_MAX) {
+		data = stbi_load_from_memory(ctx->request, (int) length, &width, &height, &channels, 4);
+	}
+	trace_end();
+
+	if (data == NULL || channels != 4) {
+		stbi_image_free(data);
+		return respond(fd, SERVE_STATUS_LOAD_FAILED, NULL, 0);
+	}
+
+	int *points = NULL;
+	size_t point_count = 0;
+	trace_begin("extract", NULL);
+	rectilinearize_image(data, width, height, &points, &point_count);
+	trace_end();
+	stbi_image_free(data);
+
+	writer_reset(&ctx->response);
+	bool encoded = true;
+	switch (format) {
+		case SERVE_FORMAT_JSON:
+			write_json(&ctx->response, points, point_count);
+			break;
+		case SERVE_FORMAT_BIN:
+			write_bin(&ctx->response, points, point_count, width, height);
+			break;
+		default:
+			encoded = write_varint(&ctx->response, points, point_count, width, height);
+			break;
+	}
+	trace_begin("respond", NULL);
+	bool ok = encoded
+		? respond(fd, SERVE_STATUS_OK, ctx->response.data, ctx->response.size)
+		: respond(fd, SERVE_STATUS_ENCODE_FAILED, NULL, 0);
+	trace_end();
+
+	free(points);
+	return ok;
+}
+
+// The request slice of the trace starts once the header arrived, so it never includes the time the client took to
+// send it
+static bool handle_request(Serve_Context *ctx, int fd) {
+	unsigned char header[8];
+	ctx->deadline_ms = now_ms() + SERVE_REQUEST_TIMEOUT_MS;
+	if (!read_full(fd, header, sizeof header, ctx->deadline_ms)) {
+		return false;
+	}
+
+	trace_begin("request", NULL);
+	bool ok = answer_request(ctx, fd, header);
+	trace_end();
+	return ok;
+}
+
+// Answers one request at a time from whichever connection has one waiting. A worker only ever waits for the rest of
+// a request that already started arriving, for at most SERVE_REQUEST_TIMEOUT_MS, idle connections are left to the
+// dispatcher.
+static void *serve_worker(void *arg) {
+	Serve_Context *ctx = arg;
+	trace_thread_name("serve");
+	int fd;
+	while ((fd = queue_pop(&ctx->serve->queue, &ctx->fd)) >= 0) {
+		bool ok = handle_request(ctx, fd);
+		bool stopping = queue_done(&ctx->serve->queue, &ctx->fd);
+		if (ok && !stopping) {
+			watch(ctx->serve->epoll_fd, fd);
+		} else {
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+int serve(const char *socket_path, size_t threads) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof addr.sun_path) {
+		PANIC("Socket path %s is too long", socket_path);
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		PANIC("Could not create socket: %s", strerror(errno));
+	}
+
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		PANIC("Could not bind %s: %s", socket_path, strerror(errno));
+	}
+	if (listen(listen_fd, SOMAXCONN) < 0) {
+		PANIC("Could not listen on %s: %s", socket_path, strerror(errno));
+	}
+
+	// The workers inherit the blocked signals, so they only ever arrive through the signalfd of the dispatcher
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+	int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		PANIC("Could not create signalfd: %s", strerror(errno));
+	}
+
+	Serve serve = { .epoll_fd = epoll_create1(EPOLL_CLOEXEC) };
+	if (serve.epoll_fd < 0) {
+		PANIC("Could not create epoll instance: %s", strerror(errno));
+	}
+	pthread_mutex_init(&serve.queue.lock, NULL);
+	pthread_cond_init(&serve.queue.ready, NULL);
+
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = listen_fd };
+	if (epoll_ctl(serve.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+		PANIC("Could not watch %s: %s", socket_path, strerror(errno));
+	}
+	event.data.fd = signal_fd;
+	if (epoll_ctl(serve.epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+		PANIC("Could not watch signals: %s", strerror(errno));
+	}
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (size_t) cpus : 1;
+	}
+
+	Serve_Context *contexts = calloc(threads, sizeof *contexts);
+	pthread_t *workers = calloc(threads, sizeof *workers);
+	if (contexts == NULL || workers == NULL) {
+		PANIC("Could not allocate %zu workers", threads);
+	}
+
+	for (size_t i = 0; i < threads; ++i) {
+		Serve_Context *ctx = &contexts[i];
+		ctx->serve = &serve;
+		ctx->fd = -1;
+		ctx->request_capacity = 64 << 10;
+		ctx->request = malloc(ctx->request_capacity);
+		if (ctx->request == NULL) {
+			PANIC("Could not allocate worker buffers");
+		}
+		writer_init_mem(&ctx->response, 64 << 10);
+
+		if (pthread_create(&workers[i], NULL, serve_worker, ctx) != 0) {
+			PANIC("Could not start worker thread");
+		}
+	}
+
+	// This thread accepts connections and hands every connection with a request waiting to the workers
+	INFO("Serving on %s with %zu workers", socket_path, threads);
+	bool running = true;
+	while (running) {
+		struct epoll_event events[64];
+		int n = epoll_wait(serve.epoll_fd, events, sizeof events / sizeof *events, -1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			PANIC("epoll_wait failed: %s", strerror(errno));
+		}
+
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == signal_fd) {
+				running = false;
+			} else if (fd == listen_fd) {
+				int conn = accept(listen_fd, NULL, NULL);
+				if (conn < 0 && errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+					PANIC("accept failed: %s", strerror(errno));
+				}
+				if (conn >= 0) {
+					// A client that does not read its responses can not block a worker in `respond` for longer either
+					struct timeval timeout = {
+						.tv_sec = SERVE_REQUEST_TIMEOUT_MS / 1000, .tv_usec = SERVE_REQUEST_TIMEOUT_MS % 1000 * 1000
+					};
+					setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+					watch(serve.epoll_fd, conn);
+				}
+			} else {
+				// The worker watches the connection again once the request is answered
+				if (epoll_ctl(serve.epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+					PANIC("Could not hand over connection: %s", strerror(errno));
+				}
+				queue_push(&serve.queue, fd);
+			}
+		}
+	}
+	unlink(socket_path);
+
+	// Workers still waiting for the rest of a request stop waiting, requests that arrived in full are still answered,
+	// including those still in the queue
+	pthread_mutex_lock(&serve.queue.lock);
+	serve.queue.stopping = true;
+	for (size_t i = 0; i < threads; ++i) {
+		if (contexts[i].fd >= 0) {
+			shutdown(contexts[i].fd, SHUT_RD);
+		}
+	}
+	pthread_cond_broadcast(&serve.queue.ready);
+	pthread_mutex_unlock(&serve.queue.lock);
+
+	for (size_t i = 0; i < threads; ++i) {
+		pthread_join(workers[i], NULL);
+		free(contexts[i].request);
+		writer_free(&contexts[i].response);
+	}
+
+	// Connections that were waiting for their next request are closed with the process
+	free(serve.queue.fds);
+	pthread_cond_destroy(&serve.queue.ready);
+	pthread_mutex_destroy(&serve.queue.lock);
+	close(serve.epoll_fd);
+	close(signal_fd);
+	close(listen_fd);
+	free(contexts);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every request and response starts with an 8 byte little-endian header followed by 'length' bytes of payload.
+// A connection may carry any number of requests, they are answered in order. Binary responses use the binary polygon
+// format described by `RectilinearizeBinHeader`.
+//
+//   Request:  u8 kind ('P' path, 'D' png data), u8 format ('J' json, 'B' binary, 'V' varint), u16 reserved, u32 length
+//   Response: u32 status (0 on success), u32 length
+#define SERVE_KIND_PATH     'P'
+#define SERVE_KIND_DATA     'D'
+#define SERVE_FORMAT_JSON   'J'
+#define SERVE_FORMAT_BIN    'B'
+#define SERVE_FORMAT_VARINT 'V'
+
+#define SERVE_STATUS_OK            0
+#define SERVE_STATUS_BAD_REQUEST   1
+#define SERVE_STATUS_LOAD_FAILED   2
+#define SERVE_STATUS_ENCODE_FAILED 3
+
+// Requests with a larger payload are rejected and the connection is closed
+#define SERVE_MAX_PAYLOAD (256u << 20)
+
+// Once the first byte of a request arrived the rest of it has to follow within this time, and every response has to
+// be taken by the client within this time, or the connection is closed
+#define SERVE_REQUEST_TIMEOUT_MS 5000
+
+/**
+ * @brief Listens on the unix domain socket at 'socket_path' and answers requests until SIGINT or SIGTERM arrives.
+ *
+ * Requests that are being answered or waiting for a worker when the signal arrives are finished before it returns, as
+ * long as they arrived in full. Idle connections are closed without a response.
+ *
+ * The calling thread accepts connections and waits for requests on all of them, handing every connection with a request
+ * waiting to one of 'threads' workers. The workers keep their buffers alive between requests, so a request only pays
+ * for decoding and extraction.
+ */
+int serve(const char *socket_path, size_t threads);
+
+#endif // SERVE_H_
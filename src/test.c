@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "main.h"
+
+// Tests of the library, built against the static library and run by `./nobuild --test`. Every test returns false after
+// reporting the first check that failed.
+
+#define CHECK(cond)                          \
+	do {                                     \
+		if (!(cond)) {                       \
+			ERRO("Check failed: %s", #cond); \
+			return false;                    \
+		}                                    \
+	} while (0)
+
+// RGBA mask of 'width' x 'height' pixels, every pixel inside one of the 'rect_count' x, y, width, height rectangles
+// is opaque
+static unsigned char *make_mask(int width, int height, const int *rects, size_t rect_count) {
+	unsigned char *data = calloc((size_t) width * (size_t) height, 4);
+	if (data == NULL) {
+		PANIC("Could not allocate a %dx%d mask", width, height);
+	}
+	for (size_t r = 0; r < rect_count; ++r) {
+		const int *rect = rects + r * 4;
+		for (int y = rect[1]; y < rect[1] + rect[3]; ++y) {
+			memset(data + ((size_t) y * (size_t) width + (size_t) rect[0]) * 4, 255, (size_t) rect[2] * 4);
+		}
+	}
+	return data;
+}
+
+static bool same_points(const int *a, size_t a_count, const int *b, size_t b_count) {
+	return a_count == b_count && (a_count == 0 || memcmp(a, b, sizeof *a * (a_count << 1)) == 0);
+}
+
+typedef size_t (*Encode_Fn)(const int *points, size_t point_count, int width, int height, unsigned char *out);
+typedef bool (*Decode_Fn)(const unsigned char *data, size_t size, int **points, size_t *point_count, int *width, int *height);
+
+// Encodes the polygon, decodes it again and compares the result with the input. Every shorter prefix of the encoded
+// polygon has to be rejected
+static bool round_trip(Encode_Fn encode, Decode_Fn decode, const int *points, size_t point_count, int width, int height) {
+	size_t size = encode(points, point_count, width, height, NULL);
+	CHECK(size > 0);
+	unsigned char *data = malloc(size);
+	CHECK(data != NULL);
+	CHECK(encode(points, point_count, width, height, data) == size);
+
+	int *decoded = NULL;
+	size_t decoded_count = 0;
+	int decoded_width = 0, decoded_height = 0;
+	bool ok = decode(data, size, &decoded, &decoded_count, &decoded_width, &decoded_height)
+		&& same_points(points, point_count, decoded, decoded_count) && decoded_width == width && decoded_height == height;
+	free(decoded);
+
+	for (size_t n = 0; ok && n < size; ++n) {
+		decoded = NULL;
+		ok = !decode(data, n, &decoded, &decoded_count, NULL, NULL);
+		free(decoded);
+	}
+
+	free(data);
+	CHECK(ok);
+	return true;
+}
+
+// Polygons that cover the edge cases of the codecs: no polygon at all, a polygon extracted from an image, and
+// coordinates at the limits of the uint16 and int32 encodings
+static bool round_trip_cases(Encode_Fn encode, Decode_Fn decode) {
+	CHECK(round_trip(encode, decode, NULL, 0, 16, 16));
+
+	const int rects[] = { 2, 2, 4, 10, 2, 10, 12, 4 };
+	unsigned char *mask = make_mask(20, 20, rects, 2);
+	int *points = NULL;
+	size_t point_count = 0;
+	rectilinearize_image(mask, 20, 20, &points, &point_count);
+	free(mask);
+	CHECK(point_count == 6);
+	bool ok = round_trip(encode, decode, points, point_count, 20, 20);
+	free(points);
+	CHECK(ok);
+
+	const int full_u16[] = { 0, 0, 65535, 0, 65535, 65535, 0, 65535 };
+	CHECK(round_trip(encode, decode, full_u16, 4, 65535, 65535));
+
+	const int full_width[] = { 0, 0, 65536, 0, 65536, 1, 0, 1 };
+	CHECK(round_trip(encode, decode, full_width, 4, 65536, 1));
+
+	const int large[] = { 100000, 7, 2000000000, 7, 2000000000, 1000000, 100000, 1000000 };
+	CHECK(round_trip(encode, decode, large, 4, 2000000000, 1000000));
+	return true;
+}
+
+static bool test_bin_round_trip(void) {
+	CHECK(round_trip_cases(rectilinearize_bin_encode, rectilinearize_bin_decode));
+
+	int *points = NULL;
+	size_t point_count = 0;
+	const unsigned char garbage[32] = "RPLX";
+	CHECK(!rectilinearize_bin_decode(garbage, sizeof garbage, &points, &point_count, NULL, NULL));
+	return true;
+}
+
+static bool test_varint_round_trip(void) {
+	CHECK(round_trip_cases(rectilinearize_varint_encode, rectilinearize_varint_decode));
+
+	// Two vertices in a row that move along the same axis can not be stored as a single delta
+	const int collinear[] = { 0, 0, 2, 0, 4, 0, 4, 4, 0, 4 };
+	CHECK(rectilinearize_varint_encode(collinear, 5, 8, 8, NULL) == 0);
+
+	int *points = NULL;
+	size_t point_count = 0;
+	const unsigned char garbage[32] = "RPLX";
+	CHECK(!rectilinearize_varint_decode(garbage, sizeof garbage, &points, &point_count, NULL, NULL));
+	return true;
+}
+
+// Strokes are aligned to blocks of this many pixels, so they never leave the single pixel protrusions the extractor can
+// not handle
+#define STROKE_BLOCK 4
+
+// Deterministic pseudo random numbers, so a failure can be reproduced
+static uint32_t next_random(uint32_t *state) {
+	*state = *state * 1664525u + 1013904223u;
+	return *state >> 8;
+}
+
+// Paints or erases random rectangles and checks after every stroke that the updated result is the polygon a full
+// extraction of the same pixels gives
+static bool test_update_matches_extraction(void) {
+	const int size = 96;
+	const int rects[] = { 8, 8, 48, 32, 24, 40, 16, 40 };
+	unsigned char *data = make_mask(size, size, rects, 2);
+	RectilinearizeResult *result = rectilinearize_result_create(data, size, size);
+	CHECK(result != NULL);
+
+	uint32_t state = 12345;
+	bool ok = true;
+	for (int stroke = 0; ok && stroke < 500; ++stroke) {
+		int blocks = size / STROKE_BLOCK;
+		int x = (int) (next_random(&state) % (uint32_t) blocks);
+		int y = (int) (next_random(&state) % (uint32_t) blocks);
+		int w = 1 + (int) (next_random(&state) % 4);
+		int h = 1 + (int) (next_random(&state) % 4);
+		w = x + w < blocks ? w : blocks - x;
+		h = y + h < blocks ? h : blocks - y;
+		unsigned char alpha = (next_random(&state) & 1) ? 255 : 0;
+		for (int row = y * STROKE_BLOCK; row < (y + h) * STROKE_BLOCK; ++row) {
+			memset(data + ((size_t) row * (size_t) size + (size_t) (x * STROKE_BLOCK)) * 4, alpha, (size_t) (w * STROKE_BLOCK) * 4);
+		}
+		rectilinearize_result_update(result, data, x * STROKE_BLOCK, y * STROKE_BLOCK, w * STROKE_BLOCK, h * STROKE_BLOCK);
+
+		int *expected = NULL;
+		size_t expected_count = 0;
+		rectilinearize_image(data, size, size, &expected, &expected_count);
+		size_t point_count = 0;
+		const int *points = rectilinearize_result_points(result, &point_count);
+		ok = same_points(expected, expected_count, points, point_count);
+		if (!ok) {
+			ERRO("Stroke %d at %d,%d of %dx%d blocks gave %zu vertices instead of %zu", stroke, x, y, w, h, point_count,
+				expected_count);
+		}
+		free(expected);
+	}
+
+	rectilinearize_result_free(result);
+	free(data);
+	CHECK(ok);
+	return true;
+}
+
+// Everything the library allocates through its own allocator has to be returned once the result is freed. The tests
+// before this one also leave nothing behind, so no bytes may be in use at all
+static bool test_result_free_releases_everything(void) {
+	const int rects[] = { 4, 4, 40, 8, 4, 12, 8, 40 };
+	unsigned char *data = make_mask(64, 64, rects, 2);
+	RectilinearizeAllocStats stats;
+	rectilinearize_alloc_stats(&stats);
+	CHECK(stats.bytes_in_use == 0);
+	uint64_t allocations = stats.allocations;
+
+	RectilinearizeResult *result = rectilinearize_result_create(data, 64, 64);
+	CHECK(result != NULL);
+	rectilinearize_alloc_stats(&stats);
+	CHECK(stats.bytes_in_use > 0);
+
+	memset(data + (size_t) (20 * 64 + 20) * 4, 255, 8 * 4);
+	memset(data + (size_t) (21 * 64 + 20) * 4, 255, 8 * 4);
+	rectilinearize_result_update(result, data, 20, 20, 8, 2);
+	rectilinearize_result_free(result);
+	free(data);
+
+	rectilinearize_alloc_stats(&stats);
+	CHECK(stats.allocations > allocations);
+	CHECK(stats.bytes_in_use == 0);
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*run)(void);
+} tests[] = {
+	{ "bin round trip", test_bin_round_trip },
+	{ "varint round trip", test_varint_round_trip },
+	{ "update matches extraction", test_update_matches_extraction },
+	{ "result free releases everything", test_result_free_releases_everything },
+};
+
+int main(void) {
+	size_t failed = 0;
+	for (size_t i = 0; i < sizeof tests / sizeof *tests; ++i) {
+		bool ok = tests[i].run();
+		printf("%-40s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+		failed += !ok;
+	}
+
+	if (failed > 0) {
+		ERRO("%zu of %zu tests failed", failed, sizeof tests / sizeof *tests);
+		return 1;
+	}
+	return 0;
+}
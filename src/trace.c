@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "output.h"
+#include "trace.h"
+#include "writer.h"
+
+#define TRACE_CHUNK_EVENTS 1024
+
+typedef struct {
+	uint64_t ts;      // Nanoseconds since `trace_open`
+	const char *name; // NULL for the end of a slice
+	const char *file;
+} Trace_Event;
+
+// Events are appended to fixed size chunks, so a full buffer never moves the events that were already recorded
+typedef struct Trace_Chunk {
+	Trace_Event events[TRACE_CHUNK_EVENTS];
+	atomic_size_t count;              // Published after the event is written
+	_Atomic(struct Trace_Chunk *) next;
+} Trace_Chunk;
+
+typedef struct Trace_Buffer {
+	int tid;
+	_Atomic(const char *) name;
+	Trace_Chunk *first;
+	Trace_Chunk *last;                // Only touched by the owning thread
+	struct Trace_Buffer *next;        // Next buffer in `trace_buffers`, immutable once the buffer is published
+} Trace_Buffer;
+
+static atomic_bool trace_enabled = false;
+static const char *trace_path = NULL;
+static uint64_t trace_start = 0;
+static atomic_int trace_next_tid = 1;
+
+// Every thread pushes its buffer onto this list the first time it records an event
+static _Atomic(Trace_Buffer *) trace_buffers = NULL;
+static _Thread_local Trace_Buffer *trace_buffer = NULL;
+
+static uint64_t trace_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static Trace_Chunk *trace_chunk_new(void) {
+	Trace_Chunk *chunk = malloc(sizeof *chunk);
+	if (chunk == NULL) {
+		PANIC("Could not allocate trace buffer");
+	}
+	atomic_init(&chunk->count, 0);
+	atomic_init(&chunk->next, NULL);
+	return chunk;
+}
+
+static Trace_Buffer *trace_thread_buffer(void) {
+	if (trace_buffer != NULL) {
+		return trace_buffer;
+	}
+
+	Trace_Buffer *buffer = calloc(1, sizeof *buffer);
+	if (buffer == NULL) {
+		PANIC("Could not allocate trace buffer");
+	}
+	buffer->tid = atomic_fetch_add(&trace_next_tid, 1);
+	buffer->first = buffer->last = trace_chunk_new();
+
+	buffer->next = atomic_load_explicit(&trace_buffers, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&trace_buffers, &buffer->next, buffer, memory_order_release, memory_order_relaxed));
+
+	trace_buffer = buffer;
+	return buffer;
+}
+
+static void trace_record(const char *name, const char *file) {
+	Trace_Buffer *buffer = trace_thread_buffer();
+	Trace_Chunk *chunk = buffer->last;
+	size_t count = atomic_load_explicit(&chunk->count, memory_order_relaxed);
+	if (count == TRACE_CHUNK_EVENTS) {
+		Trace_Chunk *next = trace_chunk_new();
+		atomic_store_explicit(&chunk->next, next, memory_order_release);
+		buffer->last = chunk = next;
+		count = 0;
+	}
+
+	chunk->events[count] = (Trace_Event) { .ts = trace_clock() - trace_start, .name = name, .file = file };
+	atomic_store_explicit(&chunk->count, count + 1, memory_order_release);
+}
+
+void trace_open(const char *path) {
+	trace_path = path;
+	trace_start = trace_clock();
+	atomic_store(&trace_enabled, true);
+}
+
+void trace_thread_name(const char *name) {
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		atomic_store_explicit(&trace_thread_buffer()->name, name, memory_order_release);
+	}
+}
+
+void trace_begin(const char *name, const char *file) {
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		trace_record(name, file);
+	}
+}
+
+void trace_end(void) {
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		trace_record(NULL, NULL);
+	}
+}
+
+// Writes a timestamp in microseconds, which is the unit of the trace event format
+static void write_ts(Writer *out, uint64_t ns) {
+	writer_put_int(out, (long long) (ns / 1000));
+	writer_put_char(out, '.');
+	char frac[4] = { (char) ('0' + ns / 100 % 10), (char) ('0' + ns / 10 % 10), (char) ('0' + ns % 10), '\0' };
+	writer_put_str(out, frac);
+}
+
+bool trace_close(void) {
+	if (!atomic_exchange(&trace_enabled, false)) {
+		return true;
+	}
+
+	int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERRO("Could not open %s: %s", trace_path, strerror(errno));
+		return false;
+	}
+
+	Writer out;
+	writer_init_fd(&out, fd, WRITER_DEFAULT_CAPACITY);
+	writer_put_str(&out, "{\"traceEvents\":[");
+
+	bool first = true;
+	for (Trace_Buffer *buffer = atomic_load_explicit(&trace_buffers, memory_order_acquire); buffer != NULL; buffer = buffer->next) {
+		const char *name = atomic_load_explicit(&buffer->name, memory_order_acquire);
+		if (name != NULL) {
+			writer_put_str(&out, first ? "\n" : ",\n");
+			writer_put_str(&out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":");
+			writer_put_int(&out, buffer->tid);
+			writer_put_str(&out, ",\"args\":{\"name\":");
+			write_json_string(&out, name);
+			writer_put_str(&out, "}}");
+			first = false;
+		}
+
+		// Threads that are still running may add events while the buffer is written, only the published ones are read
+		for (Trace_Chunk *chunk = buffer->first; chunk != NULL; chunk = atomic_load_explicit(&chunk->next, memory_order_acquire)) {
+			size_t count = atomic_load_explicit(&chunk->count, memory_order_acquire);
+			for (size_t i = 0; i < count; ++i) {
+				const Trace_Event *event = &chunk->events[i];
+				writer_put_str(&out, first ? "\n{\"name\":" : ",\n{\"name\":");
+				write_json_string(&out, event->name != NULL ? event->name : "");
+				writer_put_str(&out, event->name != NULL ? ",\"ph\":\"B\",\"pid\":1,\"tid\":" : ",\"ph\":\"E\",\"pid\":1,\"tid\":");
+				writer_put_int(&out, buffer->tid);
+				writer_put_str(&out, ",\"ts\":");
+				write_ts(&out, event->ts);
+				if (event->file != NULL) {
+					writer_put_str(&out, ",\"args\":{\"file\":");
+					write_json_string(&out, event->file);
+					writer_put_char(&out, '}');
+				}
+				writer_put_char(&out, '}');
+				first = false;
+			}
+		}
+	}
+
+	writer_put_str(&out, "\n]}\n");
+	bool ok = writer_flush(&out);
+	writer_free(&out);
+	close(fd);
+	return ok;
+}
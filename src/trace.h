@@ -0,0 +1,31 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+
+/**
+ * @brief Starts recording trace events, which are written to 'path' by `trace_close`.
+ *
+ * Every thread records its events into its own buffer, so recording an event never takes a lock. The buffers are
+ * written in the Chrome trace event format, which can be opened in chrome://tracing or https://ui.perfetto.dev.
+ */
+void trace_open(const char *path);
+
+// Writes every recorded event to the path given to `trace_open`. Returns false if the file could not be written
+bool trace_close(void);
+
+// Names the calling thread in the trace
+void trace_thread_name(const char *name);
+
+/**
+ * @brief Marks the start of a slice on the calling thread, which lasts until the matching `trace_end`.
+ *
+ * @param name Name of the slice. Has to stay valid until `trace_close`.
+ * @param file Shown as the `file` argument of the slice, or NULL. Has to stay valid until `trace_close`.
+ *
+ * @note Does nothing unless `trace_open` was called.
+ */
+void trace_begin(const char *name, const char *file);
+void trace_end(void);
+
+#endif // TRACE_H_
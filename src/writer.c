@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <nobuild/nobuild_log.h>
+
+#include "writer.h"
+
+// Every two digit number, so integers are formatted two digits per table lookup
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static void writer_alloc(Writer *w, size_t capacity) {
+	w->data = malloc(capacity);
+	if (w->data == NULL) {
+		PANIC("Could not allocate %zu bytes for the output buffer", capacity);
+	}
+	w->capacity = capacity;
+	w->size = 0;
+	w->failed = false;
+}
+
+void writer_init_fd(Writer *w, int fd, size_t capacity) {
+	w->fd = fd;
+	w->grow = false;
+	writer_alloc(w, capacity > 0 ? capacity : WRITER_DEFAULT_CAPACITY);
+}
+
+void writer_init_mem(Writer *w, size_t capacity) {
+	w->fd = -1;
+	w->grow = true;
+	writer_alloc(w, capacity > 0 ? capacity : WRITER_DEFAULT_CAPACITY);
+}
+
+void writer_free(Writer *w) {
+	free(w->data);
+	w->data = NULL;
+	w->size = w->capacity = 0;
+}
+
+void writer_reset(Writer *w) {
+	w->size = 0;
+	w->failed = false;
+}
+
+// Writes the buffer followed by 'extra' with as few syscalls as possible
+static bool writer_writev(Writer *w, const void *extra, size_t extra_size) {
+	struct iovec iov[2] = {
+		{ .iov_base = w->data, .iov_len = w->size },
+		{ .iov_base = (void *) extra, .iov_len = extra_size },
+	};
+	struct iovec *v = iov;
+	int count = extra_size > 0 ? 2 : 1;
+	while (count > 0 && !w->failed) {
+		ssize_t n = writev(w->fd, v, count);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			ERRO("Could not write output: %s", strerror(errno));
+			w->failed = true;
+			break;
+		}
+
+		size_t written = (size_t) n;
+		while (count > 0 && written >= v->iov_len) {
+			written -= v->iov_len;
+			v += 1;
+			count -= 1;
+		}
+		if (count > 0) {
+			v->iov_base = (char *) v->iov_base + written;
+			v->iov_len -= written;
+		}
+	}
+
+	w->size = 0;
+	return !w->failed;
+}
+
+bool writer_flush(Writer *w) {
+	if (w->fd < 0 || w->size == 0) {
+		return !w->failed;
+	}
+	return writer_writev(w, NULL, 0);
+}
+
+static void writer_grow(Writer *w, size_t size) {
+	size_t capacity = w->capacity;
+	while (capacity - w->size < size) {
+		capacity <<= 1;
+	}
+
+	char *data = realloc(w->data, capacity);
+	if (data == NULL) {
+		PANIC("Could not grow the output buffer to %zu bytes", capacity);
+	}
+	w->data = data;
+	w->capacity = capacity;
+}
+
+unsigned char *writer_reserve(Writer *w, size_t size) {
+	if (w->capacity - w->size < size) {
+		if (!w->grow) {
+			writer_flush(w);
+		}
+		if (w->capacity - w->size < size) {
+			writer_grow(w, size);
+		}
+	}
+	return (unsigned char *) w->data + w->size;
+}
+
+void writer_commit(Writer *w, size_t size) {
+	w->size += size;
+}
+
+void writer_put(Writer *w, const void *data, size_t size) {
+	if (w->capacity - w->size >= size) {
+		memcpy(w->data + w->size, data, size);
+		w->size += size;
+		return;
+	}
+
+	// Large blocks skip the copy and go out together with the buffer in one `writev`
+	if (!w->grow) {
+		writer_writev(w, data, size);
+		return;
+	}
+
+	writer_grow(w, size);
+	memcpy(w->data + w->size, data, size);
+	w->size += size;
+}
+
+void writer_put_str(Writer *w, const char *str) {
+	writer_put(w, str, strlen(str));
+}
+
+void writer_put_char(Writer *w, char c) {
+	if (w->size == w->capacity) {
+		writer_reserve(w, 1);
+	}
+	w->data[w->size++] = c;
+}
+
+void writer_put_int(Writer *w, long long v) {
+	char buf[24];
+	char *end = buf + sizeof buf;
+	char *p = end;
+
+	unsigned long long u = v < 0 ? 0ull - (unsigned long long) v : (unsigned long long) v;
+	while (u >= 100) {
+		const char *pair = digit_pairs + (u % 100) * 2;
+		u /= 100;
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+	if (u >= 10) {
+		const char *pair = digit_pairs + u * 2;
+		*--p = pair[1];
+		*--p = pair[0];
+	} else {
+		*--p = (char) ('0' + u);
+	}
+	if (v < 0) {
+		*--p = '-';
+	}
+
+	writer_put(w, p, (size_t) (end - p));
+}
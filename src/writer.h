@@ -0,0 +1,43 @@
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define WRITER_DEFAULT_CAPACITY (1 << 20)
+
+// Buffered output shared by every output format. Bytes are collected in a large buffer and handed to the kernel with
+// a single `write`/`writev` once it fills up, instead of going through locked stdio for every vertex.
+typedef struct {
+	int fd;          // Destination file descriptor, or -1 to keep everything in memory
+	bool grow;       // Grow the buffer instead of flushing when it fills up, so `writer_flush` is a single write
+	char *data;
+	size_t size;     // Number of bytes currently buffered
+	size_t capacity;
+	bool failed;     // A write to 'fd' failed, further output is dropped
+} Writer;
+
+// Creates a writer that flushes to 'fd'
+void writer_init_fd(Writer *w, int fd, size_t capacity);
+
+// Creates a writer that only keeps its output in memory. The output is found in `data` and `size`
+void writer_init_mem(Writer *w, size_t capacity);
+
+void writer_free(Writer *w);
+
+// Drops the buffered bytes without writing them
+void writer_reset(Writer *w);
+
+// Writes the buffered bytes to the file descriptor. Does nothing for memory writers
+bool writer_flush(Writer *w);
+
+// Returns space for at least 'size' bytes at the end of the buffer. Has to be followed by `writer_commit`
+unsigned char *writer_reserve(Writer *w, size_t size);
+void writer_commit(Writer *w, size_t size);
+
+void writer_put(Writer *w, const void *data, size_t size);
+void writer_put_str(Writer *w, const char *str);
+void writer_put_char(Writer *w, char c);
+void writer_put_int(Writer *w, long long v);
+
+#endif // WRITER_H_